@@ -0,0 +1,155 @@
+/*
+ * ==========================================================
+ *
+ * Kernel API compatibility of the pci-char driver
+ * Copyright (C) 2012-2014  Andre Richter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ==========================================================
+ *
+ * The driver is written against current mainline. This header
+ * maps the interfaces that changed since the oldest maintained
+ * LTS kernel, 5.10, onto what the running kernel provides.
+ */
+
+#ifndef _PCI_CHAR_COMPAT_H
+#define _PCI_CHAR_COMPAT_H
+
+#include <linux/version.h>
+
+/* 6.2 constified the device passed to devnode() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define PCHAR_DEVNODE_CONST const
+#else
+#define PCHAR_DEVNODE_CONST
+#endif
+
+/* 6.3 made vm_flags read-only outside of the accessors */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define pchar_vm_flags_set(vma, flags)		vm_flags_set(vma, flags)
+#define pchar_vm_flags_clear(vma, flags)	vm_flags_clear(vma, flags)
+#else
+#define pchar_vm_flags_set(vma, flags)		((vma)->vm_flags |= (flags))
+#define pchar_vm_flags_clear(vma, flags)	((vma)->vm_flags &= ~(flags))
+#endif
+
+/* 6.4 dropped the owner argument of class_create() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define pchar_class_create(name)	class_create(name)
+#else
+#define pchar_class_create(name)	class_create(THIS_MODULE, name)
+#endif
+
+/* 6.8 dropped the always 1 count argument of eventfd_signal() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define pchar_eventfd_signal(ctx)	eventfd_signal(ctx)
+#else
+#define pchar_eventfd_signal(ctx)	eventfd_signal(ctx, 1)
+#endif
+
+/*
+ * 6.12 allowed PFN maps at PMD/PUD level, huge_fault() gets the order
+ * since 6.6. Older kernels map BARs with PTEs only.
+ */
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+#define PCHAR_HUGE_PFNMAP
+#endif
+
+/* 6.17 removed pfn_t, page frame numbers are passed as they are */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define pchar_insert_pfn_pmd(vmf, pfn, w)	vmf_insert_pfn_pmd(vmf, pfn, w)
+#define pchar_insert_pfn_pud(vmf, pfn, w)	vmf_insert_pfn_pud(vmf, pfn, w)
+#else
+#include <linux/pfn_t.h>
+#define pchar_insert_pfn_pmd(vmf, pfn, w) \
+	vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), w)
+#define pchar_insert_pfn_pud(vmf, pfn, w) \
+	vmf_insert_pfn_pud(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), w)
+#endif
+
+/* The supported resizable BAR sizes are exported since 5.12 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define pchar_rebar_sizes(pdev, bar)	pci_rebar_get_possible_sizes(pdev, bar)
+#else
+#define pchar_rebar_sizes(pdev, bar)	0
+#endif
+
+/*
+ * 6.18 moved releasing and reassigning the BARs of a device into
+ * pci_resize_resource(), before the caller had to do it.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
+#define pchar_resize_bar(pdev, bar, size) \
+	pci_resize_resource(pdev, bar, size, 0)
+#define pchar_assign_bars(pdev)		do { } while (0)
+#else
+static inline int pchar_resize_bar(struct pci_dev *pdev, int bar, int size)
+{
+	pci_release_resource(pdev, bar);
+	return pci_resize_resource(pdev, bar, size);
+}
+#define pchar_assign_bars(pdev)	pci_assign_unassigned_bus_resources((pdev)->bus)
+#endif
+
+/* 6.13 added hrtimer_setup(), setting the callback with the timer */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define pchar_hrtimer_setup(timer, fn, clock, mode) \
+	hrtimer_setup(timer, fn, clock, mode)
+#else
+#define pchar_hrtimer_setup(timer, fn, clock, mode) \
+	do { \
+		hrtimer_init(timer, clock, mode); \
+		(timer)->function = fn; \
+	} while (0)
+#endif
+
+/*
+ * P2PDMA memory can be mapped by user space and pinned with
+ * FOLL_PCI_P2PDMA for O_DIRECT since 6.2.
+ */
+#if IS_ENABLED(CONFIG_PCI_P2PDMA) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#include <linux/pci-p2pdma.h>
+#define PCHAR_P2PDMA
+#endif
+
+/*
+ * Block devices need blk_mq_alloc_disk() and a failing add_disk(),
+ * both there since 5.15. 6.0 folded blk_cleanup_disk() into
+ * put_disk(), 6.9 passes the queue limits at allocation and since
+ * 6.11 queues are non-rotational unless told otherwise.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+#define PCHAR_BLK
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#define pchar_cleanup_disk(disk)	put_disk(disk)
+#else
+#define pchar_cleanup_disk(disk)	blk_cleanup_disk(disk)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+#define pchar_alloc_disk(set, lim, data)	blk_mq_alloc_disk(set, lim, data)
+#elif defined(PCHAR_BLK)
+static inline struct gendisk *pchar_alloc_disk(struct blk_mq_tag_set *set,
+					       struct queue_limits *lim,
+					       void *data)
+{
+	struct gendisk *disk = blk_mq_alloc_disk(set, data);
+
+	if (!IS_ERR(disk)) {
+		blk_queue_logical_block_size(disk->queue,
+					     lim->logical_block_size);
+		blk_queue_max_hw_sectors(disk->queue, lim->max_hw_sectors);
+		blk_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+	}
+	return disk;
+}
+#endif
+
+#endif /* _PCI_CHAR_COMPAT_H */
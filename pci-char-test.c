@@ -0,0 +1,451 @@
+/*
+ * ==========================================================
+ *
+ * KUnit tests of the pci-char file interface
+ * Copyright (C) 2012-2014  Andre Richter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ==========================================================
+ *
+ * Included at the end of pci-char.c, so the static file operations
+ * are called directly. BARs are plain kernel memory and the buffers
+ * passed to them live in a user mapping of the test thread, so faults
+ * are real. Needs kunit_vm_mmap() from 6.10. Every case logs its run
+ * time, README.md shows how to run the suite.
+ */
+
+#include <kunit/test.h>
+#include <linux/mman.h>
+
+#define TEST_BAR0_LEN	(4 * RW_SLICE)	/* large transfers reschedule */
+#define TEST_BAR1_LEN	SZ_64K
+#define TEST_BATCH_OPS	SZ_64K
+
+struct pchar_test {
+	struct pci_char *pchar;
+	struct pchar_file *pf;
+	struct file *file;
+	u32 *mem[2];		/* backing of BAR 0 and 1 */
+	u64 start;
+};
+
+KUNIT_DEFINE_ACTION_WRAPPER(pchar_test_vfree, vfree, const void *);
+KUNIT_DEFINE_ACTION_WRAPPER(pchar_test_free_percpu, free_percpu,
+			    void __percpu *);
+
+/* Never all ones, which would make the driver ask config space */
+static inline u32 pattern(unsigned int i)
+{
+	return 0x5a000000 ^ i;
+}
+
+static u32 *test_bar(struct kunit *test, struct pchar_test *t,
+		     unsigned int num, size_t len)
+{
+	struct bar_t *bar = &t->pchar->bar[num];
+	unsigned int i;
+	u32 *mem;
+
+	mem = vmalloc(len);
+	KUNIT_ASSERT_NOT_NULL(test, mem);
+	KUNIT_ASSERT_EQ(test, 0, kunit_add_action_or_reset(test,
+				 pchar_test_vfree, mem));
+	for (i = 0; i < len / 4; i++)
+		mem[i] = pattern(i);
+
+	bar->len = len;
+	bar->addr = (void __iomem *)mem;
+	bar->parent = num;
+	bar->stats = t->pchar->stats;
+	return mem;
+}
+
+static int pchar_test_init(struct kunit *test)
+{
+	struct pci_char *pchar;
+	struct pchar_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t);
+
+	pchar = kunit_kzalloc(test, sizeof(*pchar), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pchar);
+	pchar->stats = alloc_percpu(struct pchar_stats);
+	KUNIT_ASSERT_NOT_NULL(test, pchar->stats);
+	KUNIT_ASSERT_EQ(test, 0, kunit_add_action_or_reset(test,
+				 pchar_test_free_percpu, pchar->stats));
+	mutex_init(&pchar->cfg_lock);
+	init_rwsem(&pchar->io_rwsem);
+	init_waitqueue_head(&pchar->state_wq);
+	t->pchar = pchar;
+
+	t->mem[0] = test_bar(test, t, 0, TEST_BAR0_LEN);
+	t->mem[1] = test_bar(test, t, 1, TEST_BAR1_LEN);
+
+	t->pf = kunit_kzalloc(test, sizeof(*t->pf), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t->pf);
+	t->pf->pchar = pchar;
+	t->pf->writable = true;
+	mutex_init(&t->pf->lock);
+
+	t->file = kunit_kzalloc(test, sizeof(*t->file), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t->file);
+	t->file->f_op = &fops;
+	t->file->private_data = t->pf;
+
+	test->priv = t;
+	t->start = ktime_get_ns();
+	return 0;
+}
+
+static void pchar_test_exit(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+
+	if (t)
+		kunit_info(test, "took %llu us\n",
+			   (ktime_get_ns() - t->start) / NSEC_PER_USEC);
+}
+
+/* len bytes of user memory, the range from hole on unmapped */
+static void __user *test_ubuf(struct kunit *test, size_t len, size_t hole)
+{
+	unsigned long addr;
+
+	addr = kunit_vm_mmap(test, NULL, 0, len, PROT_READ | PROT_WRITE,
+			     MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	KUNIT_ASSERT_NE_MSG(test, addr, 0, "no user mm");
+	KUNIT_ASSERT_LT_MSG(test, addr, (unsigned long)TASK_SIZE,
+			    "no user memory");
+	if (hole < len)
+		KUNIT_ASSERT_EQ(test, 0, vm_munmap(addr + hole, len - hole));
+
+	return (void __user *)addr;
+}
+
+static ssize_t test_read(struct pchar_test *t, void __user *buf,
+			 size_t count)
+{
+	return dev_read(t->file, buf, count, &t->file->f_pos);
+}
+
+static ssize_t test_write(struct pchar_test *t, const void __user *buf,
+			  size_t count)
+{
+	return dev_write(t->file, buf, count, &t->file->f_pos);
+}
+
+static void pchar_test_seek(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	struct file *file = t->file;
+
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 4, SEEK_SET), 4);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 8, SEEK_CUR), 12);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, -4, SEEK_CUR), 8);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 0, SEEK_END), TEST_BAR0_LEN);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, -4, SEEK_END), TEST_BAR0_LEN - 4);
+
+	/* failures leave the position alone */
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 2, SEEK_SET), -EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 1, SEEK_CUR), -EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, -4, SEEK_SET), -EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 4, SEEK_END), -EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, -(TEST_BAR0_LEN + 4), SEEK_END),
+			-EINVAL);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 0, SEEK_DATA), -EINVAL);
+	KUNIT_EXPECT_EQ(test, file->f_pos, TEST_BAR0_LEN - 4);
+
+	/* the func node spans all six BAR windows */
+	t->pf->num = FUNC_MINOR;
+	KUNIT_EXPECT_EQ(test, dev_seek(file, 0, SEEK_END),
+			6LL << PCHAR_FUNC_BAR_SHIFT);
+	KUNIT_EXPECT_EQ(test, dev_seek(file, PCHAR_FUNC_OFFSET(1, 8), SEEK_SET),
+			PCHAR_FUNC_OFFSET(1, 8));
+}
+
+static void pchar_test_rw_alignment(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	void __user *buf = test_ubuf(test, PAGE_SIZE, PAGE_SIZE);
+
+	/* pread() and pwrite() do not pass through llseek */
+	t->file->f_pos = 2;
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), -EINVAL);
+	KUNIT_EXPECT_EQ(test, test_write(t, buf, 4), -EINVAL);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, 2);
+
+	t->file->f_pos = 4;
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 6), -EINVAL);
+	KUNIT_EXPECT_EQ(test, test_write(t, buf, 2), -EINVAL);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, 4);
+	KUNIT_EXPECT_EQ(test, t->mem[0][1], pattern(1));
+
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 8), 8);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, 12);
+}
+
+static void pchar_test_rw_bounds(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	void __user *buf = test_ubuf(test, PAGE_SIZE, PAGE_SIZE);
+	u32 val;
+
+	t->file->f_pos = TEST_BAR0_LEN - 4;
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 8), -EINVAL);
+	KUNIT_EXPECT_EQ(test, test_write(t, buf, 8), -EINVAL);
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), 4);
+	KUNIT_ASSERT_EQ(test, 0, copy_from_user(&val, buf, 4));
+	KUNIT_EXPECT_EQ(test, val, pattern(TEST_BAR0_LEN / 4 - 1));
+
+	/* at the end nothing is left, past it is an error */
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 0), 0);
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), -EINVAL);
+	t->file->f_pos = TEST_BAR0_LEN + 4;
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), -EINVAL);
+	t->file->f_pos = -4;
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), -EINVAL);
+
+	/* func node: BAR 1 is there, BAR 2 is not */
+	t->pf->num = FUNC_MINOR;
+	t->file->f_pos = PCHAR_FUNC_OFFSET(1, TEST_BAR1_LEN - 4);
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), 4);
+	KUNIT_ASSERT_EQ(test, 0, copy_from_user(&val, buf, 4));
+	KUNIT_EXPECT_EQ(test, val, pattern(TEST_BAR1_LEN / 4 - 1));
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), -EINVAL);
+	t->file->f_pos = PCHAR_FUNC_OFFSET(2, 0);
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 4), -EINVAL);
+}
+
+/* A fault midway returns what was done and advances by exactly that */
+static void pchar_test_rw_partial_fault(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	void __user *buf = test_ubuf(test, 2 * PAGE_SIZE, PAGE_SIZE);
+	u32 *kbuf;
+	unsigned int i;
+
+	kbuf = kunit_kmalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, kbuf);
+
+	t->file->f_pos = 0;
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, 2 * PAGE_SIZE), PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, PAGE_SIZE);
+	KUNIT_ASSERT_EQ(test, 0, copy_from_user(kbuf, buf, PAGE_SIZE));
+	for (i = 0; i < PAGE_SIZE / 4; i++)
+		KUNIT_ASSERT_EQ(test, kbuf[i], pattern(i));
+
+	/* nothing done at all is the error */
+	KUNIT_EXPECT_EQ(test, test_read(t, buf + PAGE_SIZE, 4), -EFAULT);
+	KUNIT_EXPECT_EQ(test, test_write(t, buf + PAGE_SIZE, 4), -EFAULT);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, PAGE_SIZE);
+
+	for (i = 0; i < PAGE_SIZE / 4; i++)
+		kbuf[i] = ~pattern(i);
+	KUNIT_ASSERT_EQ(test, 0, copy_to_user(buf, kbuf, PAGE_SIZE));
+	t->file->f_pos = 0;
+	KUNIT_EXPECT_EQ(test, test_write(t, buf, 2 * PAGE_SIZE), PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, PAGE_SIZE);
+	for (i = 0; i < 2 * PAGE_SIZE / 4; i++)
+		KUNIT_ASSERT_EQ(test, t->mem[0][i],
+				i < PAGE_SIZE / 4 ? ~pattern(i) : pattern(i));
+	KUNIT_EXPECT_TRUE(test, test_bit(0, &t->pf->dirty));
+}
+
+/* The whole BAR in one call, across several reschedule points */
+static void pchar_test_rw_large(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	void __user *buf = test_ubuf(test, TEST_BAR0_LEN, TEST_BAR0_LEN);
+	u32 *kbuf;
+	unsigned int i;
+	u64 ns;
+
+	kbuf = vmalloc(TEST_BAR0_LEN);
+	KUNIT_ASSERT_NOT_NULL(test, kbuf);
+	KUNIT_ASSERT_EQ(test, 0, kunit_add_action_or_reset(test,
+				 pchar_test_vfree, kbuf));
+	for (i = 0; i < TEST_BAR0_LEN / 4; i++)
+		kbuf[i] = pattern(i) ^ 0x00a50000;
+	KUNIT_ASSERT_EQ(test, 0, copy_to_user(buf, kbuf, TEST_BAR0_LEN));
+
+	ns = ktime_get_ns();
+	KUNIT_EXPECT_EQ(test, test_write(t, buf, TEST_BAR0_LEN),
+			TEST_BAR0_LEN);
+	ns = ktime_get_ns() - ns;
+	kunit_info(test, "write %u KiB: %llu us\n", TEST_BAR0_LEN / SZ_1K,
+		   ns / NSEC_PER_USEC);
+	KUNIT_EXPECT_EQ(test, memcmp(t->mem[0], kbuf, TEST_BAR0_LEN), 0);
+
+	memset(kbuf, 0, TEST_BAR0_LEN);
+	KUNIT_ASSERT_EQ(test, 0, copy_to_user(buf, kbuf, TEST_BAR0_LEN));
+	t->file->f_pos = 0;
+	ns = ktime_get_ns();
+	KUNIT_EXPECT_EQ(test, test_read(t, buf, TEST_BAR0_LEN),
+			TEST_BAR0_LEN);
+	ns = ktime_get_ns() - ns;
+	kunit_info(test, "read %u KiB: %llu us\n", TEST_BAR0_LEN / SZ_1K,
+		   ns / NSEC_PER_USEC);
+	KUNIT_EXPECT_EQ(test, t->file->f_pos, TEST_BAR0_LEN);
+	KUNIT_ASSERT_EQ(test, 0, copy_from_user(kbuf, buf, TEST_BAR0_LEN));
+	KUNIT_EXPECT_EQ(test, memcmp(t->mem[0], kbuf, TEST_BAR0_LEN), 0);
+}
+
+/* ops and the batch header in user memory, as PCHAR_IOC_BATCH sees them */
+static long test_batch(struct kunit *test, struct pchar_test *t,
+		       void __user *ubuf, const struct pchar_op *ops,
+		       u32 nr)
+{
+	struct pchar_batch b = {
+		.ops = (u64)(unsigned long)(ubuf + sizeof(b)),
+		.nr_ops = nr,
+	};
+
+	KUNIT_ASSERT_EQ(test, 0, copy_to_user(ubuf, &b, sizeof(b)));
+	KUNIT_ASSERT_EQ(test, 0, copy_to_user(ubuf + sizeof(b), ops,
+					      nr * sizeof(*ops)));
+
+	return dev_ioctl(t->file, PCHAR_IOC_BATCH, (unsigned long)ubuf);
+}
+
+static void pchar_test_batch(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	void __user *buf = test_ubuf(test, PAGE_SIZE, PAGE_SIZE);
+	struct pchar_batch b;
+	struct pchar_op ops[] = {
+		{ .cmd = PCHAR_OP_WRITE, .offset = 8, .value = 0x12345678U },
+		{ .cmd = PCHAR_OP_READ, .offset = 8 },
+		{ .cmd = PCHAR_OP_READ, .offset = TEST_BAR0_LEN - 4 },
+	};
+
+	KUNIT_ASSERT_EQ(test, test_batch(test, t, buf, ops, 3), 0);
+	KUNIT_EXPECT_EQ(test, t->mem[0][2], 0x12345678U);
+	KUNIT_EXPECT_TRUE(test, test_bit(0, &t->pf->dirty));
+
+	/* read values come back in place */
+	KUNIT_ASSERT_EQ(test, 0, copy_from_user(ops, buf + sizeof(b),
+						sizeof(ops)));
+	KUNIT_EXPECT_EQ(test, ops[1].value, 0x12345678U);
+	KUNIT_EXPECT_EQ(test, ops[2].value, pattern(TEST_BAR0_LEN / 4 - 1));
+
+	/* the func node names the BAR per op */
+	t->pf->num = FUNC_MINOR;
+	ops[0].bar = 1;
+	ops[1].bar = 1;
+	ops[2].bar = 0;
+	KUNIT_ASSERT_EQ(test, test_batch(test, t, buf, ops, 3), 0);
+	KUNIT_EXPECT_EQ(test, t->mem[1][2], 0x12345678U);
+	KUNIT_EXPECT_TRUE(test, test_bit(1, &t->pf->dirty));
+}
+
+/* A bad op fails the whole batch before any of it runs */
+static void pchar_test_batch_invalid(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	void __user *buf = test_ubuf(test, 2 * PAGE_SIZE, PAGE_SIZE);
+	struct pchar_batch b = {
+		.ops = (u64)(unsigned long)(buf + PAGE_SIZE),
+		.nr_ops = 1,
+	};
+	struct pchar_op ops[2] = {
+		{ .cmd = PCHAR_OP_WRITE, .offset = 0, .value = 0x12345678U },
+		{ .cmd = PCHAR_OP_READ },
+	};
+
+	ops[1].offset = 2;
+	KUNIT_EXPECT_EQ(test, test_batch(test, t, buf, ops, 2), -EINVAL);
+	ops[1].offset = TEST_BAR0_LEN;
+	KUNIT_EXPECT_EQ(test, test_batch(test, t, buf, ops, 2), -EINVAL);
+	ops[1].offset = 0;
+	ops[1].bar = 1;		/* not the BAR of the node */
+	KUNIT_EXPECT_EQ(test, test_batch(test, t, buf, ops, 2), -EINVAL);
+	ops[1].bar = 6;
+	KUNIT_EXPECT_EQ(test, test_batch(test, t, buf, ops, 2), -EINVAL);
+	ops[1].bar = 0;
+	ops[1].cmd = PCHAR_OP_WRITE + 1;
+	KUNIT_EXPECT_EQ(test, test_batch(test, t, buf, ops, 2), -EINVAL);
+	KUNIT_EXPECT_EQ(test, t->mem[0][0], pattern(0));
+
+	ops[1].cmd = PCHAR_OP_READ;
+	t->pf->writable = false;
+	KUNIT_EXPECT_EQ(test, test_batch(test, t, buf, ops, 2), -EBADF);
+	KUNIT_EXPECT_EQ(test, t->mem[0][0], pattern(0));
+	t->pf->writable = true;
+
+	/* too many ops, ops on unmapped memory, no header at all */
+	b.nr_ops = MAX_OPS + 1;
+	KUNIT_ASSERT_EQ(test, 0, copy_to_user(buf, &b, sizeof(b)));
+	KUNIT_EXPECT_EQ(test, dev_ioctl(t->file, PCHAR_IOC_BATCH,
+					(unsigned long)buf), -E2BIG);
+	b.nr_ops = 1;
+	KUNIT_ASSERT_EQ(test, 0, copy_to_user(buf, &b, sizeof(b)));
+	KUNIT_EXPECT_EQ(test, dev_ioctl(t->file, PCHAR_IOC_BATCH,
+					(unsigned long)buf), -EFAULT);
+	KUNIT_EXPECT_EQ(test, dev_ioctl(t->file, PCHAR_IOC_BATCH,
+					(unsigned long)(buf + PAGE_SIZE)),
+			-EFAULT);
+	KUNIT_EXPECT_EQ(test, t->mem[0][0], pattern(0));
+}
+
+static void pchar_test_batch_large(struct kunit *test)
+{
+	struct pchar_test *t = test->priv;
+	size_t size = sizeof(struct pchar_batch) +
+		      TEST_BATCH_OPS * sizeof(struct pchar_op);
+	void __user *buf = test_ubuf(test, size, size);
+	struct pchar_op *ops;
+	unsigned int i;
+	u64 ns;
+
+	ops = kvcalloc(TEST_BATCH_OPS, sizeof(*ops), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ops);
+	for (i = 0; i < TEST_BATCH_OPS; i++) {
+		ops[i].cmd = PCHAR_OP_READ;
+		ops[i].offset = i * 4;
+	}
+
+	ns = ktime_get_ns();
+	KUNIT_EXPECT_EQ(test, test_batch(test, t, buf, ops, TEST_BATCH_OPS),
+			0);
+	ns = ktime_get_ns() - ns;
+	kunit_info(test, "%u ops: %llu us\n", TEST_BATCH_OPS,
+		   ns / NSEC_PER_USEC);
+
+	if (copy_from_user(ops, buf + sizeof(struct pchar_batch),
+			   TEST_BATCH_OPS * sizeof(*ops)))
+		KUNIT_FAIL(test, "ops not readable back");
+	else
+		for (i = 0; i < TEST_BATCH_OPS; i++)
+			if (ops[i].value != pattern(i)) {
+				KUNIT_FAIL(test, "op %u read %#x", i,
+					   ops[i].value);
+				break;
+			}
+	kvfree(ops);
+}
+
+static struct kunit_case pchar_test_cases[] = {
+	KUNIT_CASE(pchar_test_seek),
+	KUNIT_CASE(pchar_test_rw_alignment),
+	KUNIT_CASE(pchar_test_rw_bounds),
+	KUNIT_CASE(pchar_test_rw_partial_fault),
+	KUNIT_CASE(pchar_test_rw_large),
+	KUNIT_CASE(pchar_test_batch),
+	KUNIT_CASE(pchar_test_batch_invalid),
+	KUNIT_CASE(pchar_test_batch_large),
+	{}
+};
+
+static struct kunit_suite pchar_test_suite = {
+	.name = "pci-char",
+	.init = pchar_test_init,
+	.exit = pchar_test_exit,
+	.test_cases = pchar_test_cases,
+};
+
+kunit_test_suite(pchar_test_suite);
@@ -58,6 +58,54 @@
 #include <linux/device.h>
 #include <linux/kernel.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include <linux/compat.h>
+#include <linux/kthread.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/topology.h>
+#include <linux/sizes.h>
+#include <linux/firmware.h>
+#include <linux/crc32.h>
+#include <linux/file.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/dma-mapping.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <linux/kref.h>
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
+#include <linux/perf_event.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/timekeeping.h>
+#include <linux/cpuhotplug.h>
+
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+#include "pci-char.h"
+#include "pci-char-compat.h"
 
 static char ids[1024] __initdata;
 
@@ -66,128 +114,5182 @@ MODULE_PARM_DESC(ids, "Initial PCI IDs to add to the stub driver, format is "
                  "\"vendor:device[:subvendor[:subdevice[:class[:class_mask]]]]\""
 		 " and multiple comma separated entries can be specified");
 
-/* Base Address register */
+static int ro_bars;
+
+module_param(ro_bars, int, 0444);
+MODULE_PARM_DESC(ro_bars, "Bitmask of BARs that are read-only on every claimed "
+		 "device, e.g. 0x9 for bar0 and bar3");
+
+static int wc_bars;
+
+module_param(wc_bars, int, 0444);
+MODULE_PARM_DESC(wc_bars, "Bitmask of prefetchable BARs to map write "
+		 "combining, for fast bulk transfers of memory-like BARs");
+
+static int p2p_bars;
+
+module_param(p2p_bars, int, 0444);
+MODULE_PARM_DESC(p2p_bars, "Bitmask of prefetchable BARs to publish as "
+		 "P2PDMA memory, for other devices to DMA into directly");
+
+static int disk_bars;
+
+module_param(disk_bars, int, 0444);
+MODULE_PARM_DESC(disk_bars, "Bitmask of BARs of device memory to also "
+		 "expose as block devices");
+
+static unsigned int sim_spin_us = 50;
+
+module_param(sim_spin_us, uint, 0644);
+MODULE_PARM_DESC(sim_spin_us, "Microseconds to busy wait for a simulated "
+		 "device to answer before sleeping");
+
+static unsigned int status_ms = 100;
+
+module_param(status_ms, uint, 0644);
+MODULE_PARM_DESC(status_ms, "Milliseconds between refreshes of the mmap'able "
+		 "status page of each device");
+
+static unsigned long wait_spin_max_ns = 100 * NSEC_PER_USEC;
+
+module_param(wait_spin_max_ns, ulong, 0644);
+MODULE_PARM_DESC(wait_spin_max_ns, "Upper limit in nanoseconds of the busy "
+		 "polling phase of PCHAR_IOC_WAIT");
+
+static unsigned int rebar_size;
+
+module_param(rebar_size, uint, 0444);
+MODULE_PARM_DESC(rebar_size, "Grow resizable BARs to the largest supported "
+		 "size up to this many MiB at probe, 0 leaves them alone");
+
+static unsigned int irq_vectors;
+
+module_param(irq_vectors, uint, 0444);
+MODULE_PARM_DESC(irq_vectors, "Maximum number of MSI-X/MSI vectors to enable "
+		 "per device for interrupt driven waits, 0 disables interrupts");
+
+#define MAX_WINDOWS	16	/* sub-windows per device */
+#define FUNC_MINOR	(6 + MAX_WINDOWS)	/* behind BARs and windows */
+#define NR_MINORS	(FUNC_MINOR + 1)
+#define STATUS_MAX_IRQS	((PAGE_SIZE - sizeof(struct pchar_status_page)) / \
+			 sizeof(__u64))
+#define FUNC_OFF_MASK	(BIT_ULL(PCHAR_FUNC_BAR_SHIFT) - 1)
+
+#define MAX_RANGES	16
+#define MAX_ONCE	32
+#define MAX_CACHED	SZ_1M	/* bytes of register space per BAR */
+#define STAGE_SIZE	SZ_64K	/* write staging buffer per open file */
+#define RW_SLICE	SZ_1M	/* bytes read or written before rescheduling */
+#define WC_LINE		64	/* bytes per write combining line */
+#define WC_MIN		256	/* smallest transfer taking the line path */
+#define WC_CHUNK	SZ_16K	/* bytes bounced per FPU section */
+#define MAX_OPS		(1 << 20)	/* ops per batch or job */
+#define MAX_JOB_LEN	SZ_64M	/* bytes per bulk job */
+#define MAX_JOBS	64	/* queued or unreaped jobs per open file */
+#define EXEC_SLICE	SZ_1M	/* bytes executed before the next file's turn */
+#define DB_CHUNK	32	/* doorbell values copied in per step */
+#define WAIT_POLL_MIN	10	/* us between status polls without interrupt */
+#define WAIT_POLL_MAX	1000
+#define ATOMIC_BITS	6	/* log2 of the locks serialising atomics */
+#define STREAM_MAX	SZ_1G	/* bytes per capture or playback ring */
+#define SIM_MAX		8	/* simulated devices */
+#define SIM_MINORS	(1 + 6 * SIM_MAX)	/* control node, then BARs */
+#define SIM_MAX_SLOTS	4096
+#define DISK_DEPTH	64	/* requests per hardware queue */
+#define DISK_MAX_SECTORS 512	/* per request, copied without rescheduling */
+
+/*
+ * A doorbell is packed into a single u64 so that the ring path gets a
+ * consistent snapshot with one load and without any lock.
+ */
+#define DB_VALID	BIT_ULL(63)
+#define DB_64BIT	BIT_ULL(62)
+#define DB_WC		BIT_ULL(61)
+#define DB_BAR_SHIFT	56
+#define DB_BAR(db)	(((db) >> DB_BAR_SHIFT) & 0x1f)
+#define DB_OFFSET(db)	((db) & GENMASK_ULL(47, 0))
+
+/* Window [start, end) of a BAR */
+struct bar_range {
+	loff_t start;
+	loff_t end;
+};
+
+/*
+ * Access policy of a BAR. It is never modified in place apart from
+ * the once_done bits, but replaced as a whole and freed via RCU, so
+ * the access paths only pay for an rcu_dereference() when no policy
+ * is set and a binary search when one is.
+ */
+struct bar_policy {
+	struct rcu_head rcu;
+	bool ro;
+	unsigned int nr_ranges;
+	struct bar_range range[MAX_RANGES];	/* sorted, disjoint */
+	unsigned int nr_once;
+	loff_t once[MAX_ONCE];			/* sorted */
+	DECLARE_BITMAP(once_done, MAX_ONCE);
+};
+
+/*
+ * Shadow copy of registers that only software changes. Like the
+ * policy, the set of ranges is replaced as a whole, while the shadow
+ * contents are updated under the lock.
+ */
+struct bar_cache {
+	struct rcu_head rcu;
+	spinlock_t lock;
+	unsigned int nr_ranges;
+	struct bar_range range[MAX_RANGES];	/* sorted, disjoint */
+	u32 *data[MAX_RANGES];
+	unsigned long *valid[MAX_RANGES];
+};
+
+/* Driver activity, counted per CPU and summed for perf */
+enum pchar_ev {
+	EV_READS,	/* MMIO read transactions */
+	EV_WRITES,
+	EV_RD_BYTES,
+	EV_WR_BYTES,
+	EV_IRQS,
+	EV_DMA_BYTES,	/* moved by the device through streams */
+	EV_NR,
+};
+
+#define EV_REG		0x10	/* perf event reading a device register */
+
+struct pchar_stats {
+	u64 ev[EV_NR];
+};
+
+/* Error recovery pauses all access to the device */
+enum dev_state {
+	DEV_LIVE,
+	DEV_RESET,	/* being reset after an error */
+	DEV_DEAD,	/* gone for good */
+};
+
+/* Base Address register, or a sub-window aliasing part of one */
 struct bar_t {
 	resource_size_t len;
+	resource_size_t phys;
 	void __iomem *addr;
+	bool wc;		/* mapped write combining */
+	unsigned int parent;	/* BAR the entry lies in */
+	struct bar_t *pbar;	/* the same of a sub-window, NULL for BARs */
+	loff_t start;		/* of a sub-window within its BAR */
+	unsigned int users;	/* opens of a sub-window, under cfg_lock */
+	struct bar_policy __rcu *policy;
+	struct bar_cache __rcu *cache;
+	struct address_space *mapping;
+	loff_t flush_off;	/* register read back to flush posted writes */
+	atomic64_t faults[3];	/* PTE, PMD and PUD entries installed */
+	atomic64_t rd_bytes;	/* moved by read() and write() */
+	atomic64_t wr_bytes;
+	struct pchar_stats __percpu *stats;	/* of the device */
+};
+
+/*
+ * Job executor. Files with queued jobs are kept on a round robin
+ * list and every turn executes at most EXEC_SLICE worth of a job, so
+ * a long upload cannot starve the jobs of other processes.
+ */
+struct pchar_exec {
+	struct task_struct *task;
+	spinlock_t lock;
+	struct list_head active;	/* files with queued jobs */
+	struct pchar_file *cur;		/* file whose job is running */
+	wait_queue_head_t wq;		/* executor waits for work */
+	wait_queue_head_t idle_wq;	/* release waits for cur to change */
+	u64 next_id;
+	bool stopped;			/* device removed, jobs fail */
+};
+
+enum job_kind {
+	JOB_OPS,
+	JOB_BULK,
+	JOB_LOAD,
+};
+
+struct exec_job {
+	struct list_head node;
+	u64 id;
+	unsigned int num;	/* BAR of bulk and load jobs, window of ops */
+	enum job_kind kind;
+	void *buf;		/* ops, bulk data or bounce buffer */
+	void __user *uaddr;	/* where read results go back to */
+	loff_t offset;
+	size_t len;		/* ops or bytes */
+	size_t done;
+	unsigned long written;	/* BARs and windows read back on completion */
+	struct eventfd_ctx *efd;
+	int status;
+
+	/* JOB_LOAD */
+	u32 flags;
+	u32 crc;
+	u32 expect_crc;
+	const struct firmware *fw;
+	struct file *src;
+	loff_t src_pos;
+};
+
+/* MSI-X/MSI vector */
+struct pchar_irq {
+	struct pci_char *pchar;
+	atomic64_t count;
+	wait_queue_head_t wq;
+	spinlock_t lock;		/* protects efd */
+	struct eventfd_ctx *efd;
+};
+
+/*
+ * DMA ring streaming between the device and an open file, capture
+ * (device to host) or playback (host to device). Producer and consumer
+ * are free running byte counts, the device advances one of them, hw,
+ * and user space the other, sw, through the driver.
+ */
+struct pchar_stream {
+	struct device *dev;
+	struct pchar_stats __percpu *stats;
+	const enum dev_state *state;	/* of the device, hw is read if live */
+	bool tx;		/* playback */
+	size_t size;
+	u32 unit;		/* bytes per advance */
+	void *ring;
+	dma_addr_t ring_dma;
+	union {			/* status page shared with user space */
+		void *status;
+		struct pchar_capture_status *cs;
+		struct pchar_playback_status *ps;
+	};
+	dma_addr_t status_dma;
+	u32 *hw_st, *sw_st, *flags_st;	/* in the status page */
+	u32 watermark;		/* bytes available for poll() to report */
+	void __iomem *hw;	/* NULL if the device writes back */
+	void __iomem *sw;
+	void __iomem *ctrl;
+	spinlock_t lock;	/* protects sw_idx, hw_idx, edge and status */
+	u32 sw_idx;
+	u32 hw_idx;		/* last seen */
+	bool edge;		/* ring was full (capture) or empty (playback) */
+	bool running;		/* under the file's lock */
+	wait_queue_head_t *wq;	/* of the vector, or timer_wq */
+	wait_queue_head_t timer_wq;
+	struct hrtimer timer;	/* polls hw without vector */
+	ktime_t period;
+};
+
+/* What capture and playback configurations have in common */
+struct stream_cfg {
+	size_t size;
+	u32 unit;
+	u32 watermark;
+	bool writeback;
+	u32 vector;
+	u32 poll_us;
+	u32 ctrl_enable;
+	u64 base_lo, base_hi, size_reg, hw_reg, sw_reg, wb_lo, wb_hi, ctrl_reg;
+};
+
+/* Block device over the memory of a BAR */
+struct pchar_disk {
+	struct blk_mq_tag_set tags;
+	struct gendisk *disk;
+	struct bar_t *bar;
+	struct pci_char *pchar;
 };
 
 /* Private structure */
 struct pci_char {
-	struct bar_t bar[6];
+	struct kref ref;	/* probe, and one per open file */
+	struct list_head node;	/* in pchar_list while bound */
+	struct pci_dev *pdev;
+	struct bar_t bar[6 + MAX_WINDOWS];	/* BARs, then sub-windows */
 	dev_t major;
-	struct cdev cdev;
-};
+	struct cdev *cdev;	/* outlives us until its last open is gone */
+	struct mutex files_lock;	/* protects files */
+	struct list_head files;
+	struct address_space *func_mapping;
+	struct mutex cfg_lock;	/* serialises policy and cache changes */
+	struct mutex win_lock;	/* serialises sub-window changes */
+	struct pchar_exec exec;
+	u64 doorbell[PCHAR_MAX_DOORBELLS];
+	struct pchar_irq *irq;
+	unsigned int nr_irqs;
 
-static struct class *pchar_class;
+	/* atomics, hashed by the physical register address */
+	spinlock_t atomic_lock[1 << ATOMIC_BITS];
+	u32 atomic_caps;	/* AtomicOp completer sizes routed to root */
 
-static int dev_open(struct inode *inode, struct file *file)
-{
-	unsigned int num = iminor(file->f_path.dentry->d_inode);
-	struct pci_char *pchar = container_of(inode->i_cdev, struct pci_char,
-					      cdev);
+	struct pchar_disk *disk[6];
 
-	if (num > 5)
-		return -ENXIO;
+	struct pchar_stats __percpu *stats;
+#ifdef CONFIG_PERF_EVENTS
+	struct pmu pmu;
+	char pmu_name[24];
+	int pmu_cpu;		/* CPU the perf events are counted on */
+	bool pmu_registered;
+	struct hlist_node pmu_node;	/* on the CPU hotplug state */
+#endif
 
-	if (pchar->bar[num].len == 0)
-		return -EIO; /* BAR not in use or not memory type */
+	/* hybrid wait statistics */
+	atomic64_t wait_spin;
+	atomic64_t wait_sleep;
+	atomic64_t wait_timeout;
 
-	file->private_data = pchar;
+	/* status page, only written by status_work */
+	struct pchar_status_page *status;
+	struct delayed_work status_work;
+	u64 reset_ns;
 
-	return 0;
+	/* error recovery */
+	enum dev_state state;
+	struct rw_semaphore io_rwsem;	/* read held by MMIO paths */
+	wait_queue_head_t state_wq;
+	spinlock_t err_lock;		/* protects err_efd */
+	struct eventfd_ctx *err_efd;
+	atomic64_t errors;
+	atomic64_t recoveries;
+	bool paused;			/* by err_pause(), under device lock */
+	u64 reset_start;
+	u64 recovery_ns;		/* duration of the last recovery */
 };
 
-static loff_t dev_seek(struct file *file, loff_t offset, int whence)
+/* Per open file */
+struct pchar_file {
+	struct pci_char *pchar;
+	struct list_head node;	/* in pchar->files */
+	unsigned int num;	/* BAR or FUNC_MINOR */
+	bool writable;	/* opened for writing, needed by writing ioctls */
+
+	/* jobs, protected by pchar->exec.lock */
+	struct list_head exec_node;
+	struct list_head jobs;		/* queued, head may be running */
+	struct list_head done;		/* completed, not yet reaped */
+	unsigned int nr_jobs;
+	bool closing;
+	wait_queue_head_t done_wq;
+
+	/* write staging, protected by lock */
+	struct mutex lock;
+	unsigned long dirty;	/* BARs with posted writes not yet flushed */
+	bool staging;
+	void *stage_buf;
+	loff_t stage_off;
+	size_t stage_len;
+
+	/* streams, set once under lock */
+	struct pchar_stream *capture;
+	struct pchar_stream *playback;
+};
+
+static struct class *pchar_class;
+static LIST_HEAD(pchar_list);
+static DEFINE_MUTEX(pchar_list_lock);	/* protects pchar_list */
+
+/* Index of the range containing off, or -1 */
+static int range_find(const struct bar_range *range, unsigned int nr,
+		      loff_t off)
 {
-	struct inode *inode = file->f_mapping->host;
-	unsigned int num = iminor(inode);
-	struct pci_char *pchar = file->private_data;
-	loff_t new_pos;
+	unsigned int lo = 0, hi = nr, mid;
 
-	mutex_lock(&inode->i_mutex);
-	switch (whence) {
-	case SEEK_SET: /* SEEK_SET = 0 */
-		new_pos = offset;
-		break;
-	case SEEK_CUR: /* SEEK_CUR = 1 */
-		new_pos = file->f_pos + offset;
-		break;
-	default:
-		new_pos = -EINVAL;
+	/* find the last range starting at or below off */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (range[mid].start <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	mutex_unlock(&inode->i_mutex);
 
-	if (new_pos % 4)
-		return -EINVAL; /* Only allow 4 byte alignment */
+	return lo && off < range[lo - 1].end ? lo - 1 : -1;
+}
 
-	if ((new_pos < 0) || (new_pos > pchar->bar[num].len - 4))
-		return -EINVAL;
+/* Is [off, off + len) completely inside one of the allowed ranges? */
+static bool policy_in_ranges(const struct bar_policy *p, loff_t off,
+			     size_t len)
+{
+	int i;
 
-	file->f_pos = new_pos;
-	return file->f_pos;
+	if (!p->nr_ranges)
+		return true; /* no ranges means the whole BAR */
+
+	i = range_find(p->range, p->nr_ranges, off);
+
+	return i >= 0 && off + len <= p->range[i].end;
 }
 
-static ssize_t dev_read(struct file *file, char __user *buf,
-			size_t count, loff_t *ppos)
+/* Index of the first write-once register at or above off */
+static unsigned int policy_first_once(const struct bar_policy *p, loff_t off)
 {
-	struct pci_char *pchar = file->private_data;
-	u32 __user *tmp = (u32 __user *) buf;
-	u32 data;
-	u32 offset = *ppos;
-	unsigned int num = iminor(file->f_path.dentry->d_inode);
+	unsigned int lo = 0, hi = p->nr_once, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p->once[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Check an access of len bytes at off against the policy of a BAR.
+ * Write-once registers inside the window are consumed by a write that
+ * passes all other checks, if consume is set.
+ */
+static int __policy_check(struct bar_t *bar, loff_t off, size_t len,
+			  bool write, bool consume)
+{
+	struct bar_policy *p;
+	unsigned int i, first;
 	int err = 0;
-	ssize_t bytes = 0;
 
-	if (count % 4)
-		return -EINVAL; /* Only allow 32 bit reads */
+	rcu_read_lock();
+	p = rcu_dereference(bar->policy);
+	if (!p)
+		goto out;
 
-	for (; count; count -= 4) {
-		data = readl(pchar->bar[num].addr + offset);
-		if (copy_to_user(tmp, &data, 4)) {
-			err = -EFAULT;
-			break;
+	if (!policy_in_ranges(p, off, len) || (write && p->ro)) {
+		err = -EPERM;
+		goto out;
+	}
+
+	if (!write || !p->nr_once)
+		goto out;
+
+	first = policy_first_once(p, off);
+	for (i = first; i < p->nr_once && p->once[i] < off + len; i++)
+		if (test_bit(i, p->once_done)) {
+			err = -EPERM;
+			goto out;
 		}
-		tmp += 1;
-		bytes += 4;
+
+	if (!consume)
+		goto out;
+
+	for (i = first; i < p->nr_once && p->once[i] < off + len; i++)
+		if (test_and_set_bit(i, p->once_done)) {
+			err = -EPERM; /* lost a race against another writer */
+			goto out;
+		}
+out:
+	rcu_read_unlock();
+	return err;
+}
+
+/*
+ * A sub-window can only narrow down the policy of its BAR, so both
+ * have to pass before either gives up write-once registers. The BAR
+ * gives them up first: its registers are raced for by every window
+ * and the BAR itself, a write losing there must not have used up the
+ * window's.
+ */
+static int policy_check(struct bar_t *bar, loff_t off, size_t len, bool write)
+{
+	struct bar_t *pbar = bar->pbar;
+	int err;
+
+	if (!pbar)
+		return __policy_check(bar, off, len, write, true);
+
+	err = __policy_check(bar, off, len, write, false);
+	if (!err)
+		err = __policy_check(pbar, bar->start + off, len, write, true);
+	if (!err)
+		err = __policy_check(bar, off, len, write, true);
+
+	return err;
+}
+
+/*
+ * May the pages in [off, off + len) be mapped into user space? Pages
+ * holding write-once registers are never mapped writable because the
+ * driver could not see the stores.
+ */
+static bool __policy_map_ok(struct bar_t *bar, loff_t off, size_t len,
+			    bool write)
+{
+	struct bar_policy *p;
+	bool ok = true;
+	unsigned int i;
+
+	rcu_read_lock();
+	p = rcu_dereference(bar->policy);
+	if (!p)
+		goto out;
+
+	ok = policy_in_ranges(p, off, len);
+	if (ok && write) {
+		i = policy_first_once(p, off);
+		ok = !p->ro && !(i < p->nr_once && p->once[i] < off + len);
 	}
+out:
+	rcu_read_unlock();
+	return ok;
+}
 
-	return bytes ? bytes : err;
-};
+static bool policy_map_ok(struct bar_t *bar, loff_t off, size_t len,
+			  bool write)
+{
+	return __policy_map_ok(bar, off, len, write) &&
+	       (!bar->pbar ||
+		__policy_map_ok(bar->pbar, bar->start + off, len, write));
+}
 
-static ssize_t dev_write(struct file *file, const char __user *buf,
-			 size_t count, loff_t *ppos)
+/*
+ * 32 bit register accessors. Without a shadow cache they boil down
+ * to readl()/writel() after a single pointer test.
+ */
+
+/* Sub-windows share the shadow cache of the BAR they lie in */
+static inline struct bar_t *cache_bar(struct bar_t *bar, loff_t *off)
 {
-	struct pci_char *pchar = file->private_data;
-	const u32 __user *tmp = (const u32 __user *)buf;
+	if (!bar->pbar)
+		return bar;
+
+	*off += bar->start;
+	return bar->pbar;
+}
+
+/* Account nr MMIO transactions moving bytes in total */
+static inline void bar_stat(struct bar_t *bar, bool write, unsigned int nr,
+			    size_t bytes)
+{
+	this_cpu_add(bar->stats->ev[write ? EV_WRITES : EV_READS], nr);
+	this_cpu_add(bar->stats->ev[write ? EV_WR_BYTES : EV_RD_BYTES], bytes);
+}
+
+static u32 bar_read32(struct bar_t *bar, loff_t off)
+{
+	struct bar_cache *c;
+	unsigned long idx;
 	u32 data;
-	u32 offset = *ppos;
-	unsigned int num = iminor(file->f_path.dentry->d_inode);
-	int err = 0;
+	int i;
+
+	bar = cache_bar(bar, &off);
+	if (!rcu_access_pointer(bar->cache)) {
+		bar_stat(bar, false, 1, 4);
+		return readl(bar->addr + off);
+	}
+
+	rcu_read_lock();
+	c = rcu_dereference(bar->cache);
+	i = c ? range_find(c->range, c->nr_ranges, off) : -1;
+	if (i < 0) {
+		bar_stat(bar, false, 1, 4);
+		data = readl(bar->addr + off);
+		goto out;
+	}
+
+	idx = (off - c->range[i].start) / 4;
+	if (test_bit(idx, c->valid[i])) {
+		smp_rmb(); /* pairs with smp_wmb() below */
+		data = READ_ONCE(c->data[i][idx]);
+		goto out;
+	}
+
+	/* miss, fill under the lock so a racing write cannot be undone */
+	bar_stat(bar, false, 1, 4);
+	spin_lock(&c->lock);
+	data = readl(bar->addr + off);
+	WRITE_ONCE(c->data[i][idx], data);
+	smp_wmb();
+	set_bit(idx, c->valid[i]);
+	spin_unlock(&c->lock);
+out:
+	rcu_read_unlock();
+	return data;
+}
+
+static void bar_write32(struct bar_t *bar, loff_t off, u32 data)
+{
+	struct bar_cache *c;
+	unsigned long idx;
+	int i;
+
+	bar = cache_bar(bar, &off);
+	bar_stat(bar, true, 1, 4);
+	if (!rcu_access_pointer(bar->cache)) {
+		writel(data, bar->addr + off);
+		return;
+	}
+
+	rcu_read_lock();
+	c = rcu_dereference(bar->cache);
+	i = c ? range_find(c->range, c->nr_ranges, off) : -1;
+	if (i < 0) {
+		writel(data, bar->addr + off);
+		goto out;
+	}
+
+	idx = (off - c->range[i].start) / 4;
+	spin_lock(&c->lock);
+	writel(data, bar->addr + off);
+	WRITE_ONCE(c->data[i][idx], data);
+	smp_wmb();
+	set_bit(idx, c->valid[i]);
+	spin_unlock(&c->lock);
+out:
+	rcu_read_unlock();
+}
+
+/* Update the shadow copy of [off, off + len) after a bulk write */
+static void cache_update(struct bar_t *bar, loff_t off, const void *buf,
+			 size_t len)
+{
+	struct bar_cache *c;
+	loff_t start, end;
+	unsigned int i;
+
+	bar = cache_bar(bar, &off);
+	if (!rcu_access_pointer(bar->cache))
+		return;
+
+	rcu_read_lock();
+	c = rcu_dereference(bar->cache);
+	if (!c)
+		goto out;
+
+	spin_lock(&c->lock);
+	for (i = 0; i < c->nr_ranges; i++) {
+		start = max(off, c->range[i].start);
+		end = min(off + (loff_t)len, c->range[i].end);
+		if (start >= end)
+			continue;
+
+		memcpy(&c->data[i][(start - c->range[i].start) / 4],
+		       buf + (start - off), end - start);
+		smp_wmb();
+		bitmap_set(c->valid[i], (start - c->range[i].start) / 4,
+			   (end - start) / 4);
+	}
+	spin_unlock(&c->lock);
+out:
+	rcu_read_unlock();
+}
+
+/*
+ * Burst write of len bytes, 64 bit wide whenever the window allows it,
+ * so that the root complex can merge the stores into large TLPs.
+ */
+static void bar_write_burst(struct bar_t *bar, loff_t off, const void *buf,
+			    size_t len)
+{
+	if (IS_ALIGNED(off | len, 8)) {
+		__iowrite64_copy(bar->addr + off, buf, len / 8);
+		bar_stat(bar, true, len / 8, len);
+	} else {
+		__iowrite32_copy(bar->addr + off, buf, len / 4);
+		bar_stat(bar, true, len / 4, len);
+	}
+
+	cache_update(bar, off, buf, len);
+}
+
+#ifdef CONFIG_X86_64
+/*
+ * Whole lines from and to write combining BARs. Streaming loads
+ * (MOVNTDQA) fetch a line in one request instead of one request per
+ * register, and full line stores leave the write combining buffer
+ * as a single burst. The widest registers the CPU has are picked at
+ * module load; callers hold the FPU.
+ */
+static void wc_read_sse41(void *dst, const void __iomem *src, size_t lines)
+{
+	for (; lines; lines--, src += WC_LINE, dst += WC_LINE)
+		asm volatile("movntdqa   (%0), %%xmm0\n\t"
+			     "movntdqa 16(%0), %%xmm1\n\t"
+			     "movntdqa 32(%0), %%xmm2\n\t"
+			     "movntdqa 48(%0), %%xmm3\n\t"
+			     "movdqu %%xmm0,   (%1)\n\t"
+			     "movdqu %%xmm1, 16(%1)\n\t"
+			     "movdqu %%xmm2, 32(%1)\n\t"
+			     "movdqu %%xmm3, 48(%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+}
+
+static void wc_read_avx2(void *dst, const void __iomem *src, size_t lines)
+{
+	for (; lines; lines--, src += WC_LINE, dst += WC_LINE)
+		asm volatile("vmovntdqa   (%0), %%ymm0\n\t"
+			     "vmovntdqa 32(%0), %%ymm1\n\t"
+			     "vmovdqu %%ymm0,   (%1)\n\t"
+			     "vmovdqu %%ymm1, 32(%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+}
+
+static void wc_read_avx512(void *dst, const void __iomem *src, size_t lines)
+{
+	for (; lines; lines--, src += WC_LINE, dst += WC_LINE)
+		asm volatile("vmovntdqa (%0), %%zmm0\n\t"
+			     "vmovdqu64 %%zmm0, (%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+}
+
+static void wc_write_sse2(void __iomem *dst, const void *src, size_t lines)
+{
+	for (; lines; lines--, src += WC_LINE, dst += WC_LINE)
+		asm volatile("movdqu   (%0), %%xmm0\n\t"
+			     "movdqu 16(%0), %%xmm1\n\t"
+			     "movdqu 32(%0), %%xmm2\n\t"
+			     "movdqu 48(%0), %%xmm3\n\t"
+			     "movntdq %%xmm0,   (%1)\n\t"
+			     "movntdq %%xmm1, 16(%1)\n\t"
+			     "movntdq %%xmm2, 32(%1)\n\t"
+			     "movntdq %%xmm3, 48(%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+}
+
+static void wc_write_avx2(void __iomem *dst, const void *src, size_t lines)
+{
+	for (; lines; lines--, src += WC_LINE, dst += WC_LINE)
+		asm volatile("vmovdqu   (%0), %%ymm0\n\t"
+			     "vmovdqu 32(%0), %%ymm1\n\t"
+			     "vmovntdq %%ymm0,   (%1)\n\t"
+			     "vmovntdq %%ymm1, 32(%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+}
+
+static void wc_write_avx512(void __iomem *dst, const void *src, size_t lines)
+{
+	for (; lines; lines--, src += WC_LINE, dst += WC_LINE)
+		asm volatile("vmovdqu64 (%0), %%zmm0\n\t"
+			     "vmovntdq %%zmm0, (%1)"
+			     : : "r" (src), "r" (dst) : "memory");
+}
+
+static void (*wc_read_lines)(void *dst, const void __iomem *src,
+			     size_t lines);
+static void (*wc_write_lines)(void __iomem *dst, const void *src,
+			      size_t lines);
+
+static void wc_select(void)
+{
+	if (boot_cpu_has(X86_FEATURE_AVX512F)) {
+		wc_read_lines = wc_read_avx512;
+		wc_write_lines = wc_write_avx512;
+	} else if (boot_cpu_has(X86_FEATURE_AVX2)) {
+		wc_read_lines = wc_read_avx2;
+		wc_write_lines = wc_write_avx2;
+	} else {
+		if (boot_cpu_has(X86_FEATURE_XMM4_1))
+			wc_read_lines = wc_read_sse41;
+		wc_write_lines = wc_write_sse2;
+	}
+}
+
+#define wc_fpu_begin()	kernel_fpu_begin()
+#define wc_fpu_end()	kernel_fpu_end()
+#else
+static void (*wc_read_lines)(void *dst, const void __iomem *src,
+			     size_t lines);
+static void (*wc_write_lines)(void __iomem *dst, const void *src,
+			      size_t lines);
+
+static void wc_select(void)
+{
+}
+
+#define wc_fpu_begin()	do { } while (0)
+#define wc_fpu_end()	do { } while (0)
+#endif
+
+/*
+ * May [off, off + count) take the line path? Registers of a shadow
+ * cache have to go through the word accessors.
+ */
+static bool wc_usable(struct bar_t *bar, loff_t off, size_t count, bool write)
+{
+	return bar->wc && (write ? wc_write_lines : wc_read_lines) &&
+	       count >= WC_MIN && IS_ALIGNED(off, WC_LINE) &&
+	       !rcu_access_pointer((bar->pbar ?: bar)->cache);
+}
+
+/*
+ * Copy whole lines between a write combining BAR and user memory,
+ * bounced through a kernel buffer as user memory may fault while the
+ * FPU is held. Each chunk is handed to user space before the next is
+ * read, a fault loses no more than the rest of one chunk. Returns the
+ * bytes delivered, or 0 to fall back to words; *err is set on a fault.
+ */
+static ssize_t wc_copy(struct bar_t *bar, loff_t off, void __user *ubuf,
+		       size_t count, bool write, int *err)
+{
 	ssize_t bytes = 0;
+	size_t n, left;
+	void *tmp;
 
-	if (count % 4)
-		return -EINVAL; /* Only allow 32 bit writes */
+	tmp = kmalloc(WC_CHUNK, GFP_KERNEL | __GFP_NOWARN);
+	if (!tmp)
+		return 0;
 
-	for (; count; count -= 4) {
-		if (copy_from_user(&data, tmp, 4)) {
-			err = -EFAULT;
+	count = round_down(count, WC_LINE);
+	while (count) {
+		n = min_t(size_t, count, WC_CHUNK);
+		if (write) {
+			/* the lines that made it in still go out */
+			left = copy_from_user(tmp, ubuf + bytes, n);
+			n = round_down(n - left, WC_LINE);
+			wc_fpu_begin();
+			wc_write_lines(bar->addr + off + bytes, tmp,
+				       n / WC_LINE);
+			wc_fpu_end();
+			/* drain before later uncached accesses overtake */
+			wmb();
+			bar_stat(bar, true, n / WC_LINE, n);
+		} else {
+			wc_fpu_begin();
+			wc_read_lines(tmp, bar->addr + off + bytes,
+				      n / WC_LINE);
+			wc_fpu_end();
+			bar_stat(bar, false, n / WC_LINE, n);
+			left = copy_to_user(ubuf + bytes, tmp, n);
+			n = round_down(n - left, 4);
+		}
+		bytes += n;
+		count -= n;
+		if (left) {
+			*err = -EFAULT;
 			break;
 		}
-		writel(data, pchar->bar[num].addr + offset);
-		tmp += 1;
-		bytes += 4;
+		cond_resched();
 	}
 
-	return bytes ? bytes : err;
-};
+	kfree(tmp);
+	return bytes;
+}
 
-static const struct file_operations fops = {
-	.owner	 = THIS_MODULE,
-	.llseek  = dev_seek,
-	.open	 = dev_open,
-	.read	 = dev_read,
-	.write	 = dev_write,
+/* Forget the shadow copy of [off, off + len) */
+static void cache_invalidate(struct bar_t *bar, loff_t off, loff_t len)
+{
+	struct bar_cache *c;
+	loff_t start, end;
+	unsigned int i;
+
+	bar = cache_bar(bar, &off);
+	rcu_read_lock();
+	c = rcu_dereference(bar->cache);
+	if (!c)
+		goto out;
+
+	spin_lock(&c->lock);
+	for (i = 0; i < c->nr_ranges; i++) {
+		start = max(off, c->range[i].start);
+		end = min(off + len, c->range[i].end);
+		if (start < end)
+			bitmap_clear(c->valid[i],
+				     (start - c->range[i].start) / 4,
+				     (end - start) / 4);
+	}
+	spin_unlock(&c->lock);
+out:
+	rcu_read_unlock();
+}
+
+static void cache_free(struct bar_cache *c)
+{
+	unsigned int i;
+
+	if (!c)
+		return;
+
+	for (i = 0; i < c->nr_ranges; i++) {
+		kvfree(c->data[i]);
+		kvfree(c->valid[i]);
+	}
+	kfree(c);
+}
+
+static void cache_free_rcu(struct rcu_head *rcu)
+{
+	cache_free(container_of(rcu, struct bar_cache, rcu));
+}
+
+static int bar_check_bounds(struct bar_t *bar, loff_t pos, size_t count)
+{
+	if (pos < 0 || pos > bar->len || count > bar->len - pos)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Common checks of read() and write(). pread()/pwrite() bypass llseek,
+ * so the position alignment is enforced here as well.
+ */
+static int rw_check(struct bar_t *bar, loff_t pos, size_t count, bool write)
+{
+	int err;
+
+	if (pos % 4 || count % 4)
+		return -EINVAL; /* Only allow 32 bit accesses */
+
+	err = bar_check_bounds(bar, pos, count);
+	if (err)
+		return err;
+
+	return policy_check(bar, pos, count, write);
+}
+
+/*
+ * BAR addressed by a file offset. On the func device the BAR index is
+ * taken from the high bits, which are stripped from *off. NULL if the
+ * BAR does not exist.
+ */
+static struct bar_t *pf_bar(struct pchar_file *pf, loff_t *off)
+{
+	unsigned int num = pf->num;
+
+	if (num == FUNC_MINOR) {
+		if (*off < 0)
+			return NULL;
+		num = *off >> PCHAR_FUNC_BAR_SHIFT;
+		*off &= FUNC_OFF_MASK;
+		if (num > 5 || !pf->pchar->bar[num].len)
+			return NULL;
+	}
+
+	return &pf->pchar->bar[num];
+}
+
+static inline unsigned int bar_num(struct pci_char *pchar, struct bar_t *bar)
+{
+	return bar - pchar->bar;
+}
+
+/*
+ * MMIO paths hold io_rwsem for reading. Error recovery changes the
+ * state first and then drains them by taking it for writing, so the
+ * device is left alone while it is reset. New callers wait for it to
+ * come back, or fail once it is gone.
+ */
+static int io_enter(struct pci_char *pchar)
+{
+	int err;
+
+	for (;;) {
+		err = wait_event_killable(pchar->state_wq,
+					  READ_ONCE(pchar->state) != DEV_RESET);
+		if (err)
+			return err;
+
+		down_read(&pchar->io_rwsem);
+		switch (READ_ONCE(pchar->state)) {
+		case DEV_LIVE:
+			return 0;
+		case DEV_DEAD:
+			up_read(&pchar->io_rwsem);
+			return -ENODEV;
+		default:	/* reset again in the meantime */
+			up_read(&pchar->io_rwsem);
+		}
+	}
+}
+
+static inline void io_exit(struct pci_char *pchar)
+{
+	up_read(&pchar->io_rwsem);
+}
+
+/* io_enter() for paths that cannot wait or fail, false if not live */
+static bool io_try(struct pci_char *pchar)
+{
+	down_read(&pchar->io_rwsem);
+	if (READ_ONCE(pchar->state) == DEV_LIVE)
+		return true;
+
+	up_read(&pchar->io_rwsem);
+	return false;
+}
+
+static void err_notify(struct pci_char *pchar)
+{
+	spin_lock(&pchar->err_lock);
+	if (pchar->err_efd)
+		pchar_eventfd_signal(pchar->err_efd);
+	spin_unlock(&pchar->err_lock);
+}
+
+/* Fail everything from now on, without waiting for anybody */
+static void dev_mark_dead(struct pci_char *pchar)
+{
+	unsigned int i;
+
+	if (xchg(&pchar->state, DEV_DEAD) == DEV_DEAD)
+		return;
+
+	dev_err(&pchar->pdev->dev, "device is gone\n");
+	wake_up_all(&pchar->state_wq);
+	for (i = 0; i < pchar->nr_irqs; i++)
+		wake_up_all(&pchar->irq[i].wq);
+	err_notify(pchar);
+}
+
+/*
+ * A device that dropped off the bus reads all ones, each read after a
+ * completion timeout. Registers may read all ones as well, so the
+ * vendor ID in config space has the final word. Once it is gone the
+ * device is dead and every access fails right away. A link taken down
+ * by AER or DPC reads all ones and fails config reads just the same,
+ * that is -EAGAIN: recovery decides, not the reader.
+ */
+static int dev_check(struct pci_char *pchar, u32 val)
+{
+	if (likely(val != ~0U))
+		return 0;
+
+	switch (READ_ONCE(pchar->state)) {
+	case DEV_DEAD:
+		return -ENODEV;
+	case DEV_RESET:
+		return -EAGAIN;
+	default:
+		break;
+	}
+
+	if (pci_channel_offline(pchar->pdev))
+		return -EAGAIN;
+	if (pci_device_is_present(pchar->pdev))
+		return 0;
+	if (pci_channel_offline(pchar->pdev))	/* went down meanwhile */
+		return -EAGAIN;
+
+	dev_mark_dead(pchar);
+	return -ENODEV;
+}
+
+static inline void mark_dirty(struct pchar_file *pf, unsigned int num)
+{
+	if (!test_bit(num, &pf->dirty))
+		set_bit(num, &pf->dirty);
+}
+
+/* Emit the staged writes, called with pf->lock held */
+static void stage_flush(struct pchar_file *pf)
+{
+	loff_t off = pf->stage_off;
+	struct bar_t *bar;
+
+	if (!pf->stage_len)
+		return;
+
+	/* validated when staged */
+	bar = pf_bar(pf, &off);
+	bar_write_burst(bar, off, pf->stage_buf, pf->stage_len);
+	pf->stage_len = 0;
+}
+
+/* Staged writes go out ahead of any other access of the file */
+static void stage_sync(struct pchar_file *pf)
+{
+	if (!READ_ONCE(pf->stage_len))
+		return;
+
+	mutex_lock(&pf->lock);
+	stage_flush(pf);
+	mutex_unlock(&pf->lock);
+}
+
+/*
+ * Append a write to the staging buffer, called with pf->lock held.
+ * Only contiguous writes are merged, anything else flushes first.
+ */
+static ssize_t stage_write(struct pchar_file *pf, const char __user *buf,
+			   size_t count, loff_t off)
+{
+	ssize_t bytes = 0;
+	size_t chunk;
+
+	if (pf->stage_len && off != pf->stage_off + pf->stage_len)
+		stage_flush(pf);
+
+	if (!pf->stage_len)
+		pf->stage_off = off;
+
+	while (count) {
+		chunk = min_t(size_t, count, STAGE_SIZE - pf->stage_len);
+		if (copy_from_user(pf->stage_buf + pf->stage_len, buf, chunk))
+			return bytes ? bytes : -EFAULT;
+
+		pf->stage_len += chunk;
+		buf += chunk;
+		count -= chunk;
+		bytes += chunk;
+
+		if (pf->stage_len == STAGE_SIZE) {
+			stage_flush(pf);
+			pf->stage_off = off + bytes;
+		}
+	}
+
+	return bytes;
+}
+
+/* Sub-window of the file, 0 for BAR and func files */
+static inline unsigned int pf_win(struct pchar_file *pf)
+{
+	return pf->num > 5 && pf->num != FUNC_MINOR ? pf->num : 0;
+}
+
+/* BARs and windows written by a list of checked ops */
+static unsigned long ops_written(struct pchar_file *pf,
+				 const struct pchar_op *ops, size_t nr)
+{
+	unsigned long written = 0;
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		if (ops[i].cmd == PCHAR_OP_WRITE)
+			__set_bit(pf_win(pf) ?: ops[i].bar, &written);
+
+	return written;
+}
+
+/*
+ * Validate ops of a batch or job, consuming write-once registers. On
+ * a sub-window the ops name its BAR and their offsets are relative to
+ * the window.
+ */
+static int ops_check(struct pchar_file *pf, const struct pchar_op *ops,
+		     size_t nr)
+{
+	struct bar_t *bar;
+	size_t i;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		if (ops[i].bar > 5 || ops[i].offset % 4 ||
+		    ops[i].cmd > PCHAR_OP_WRITE)
+			return -EINVAL;
+
+		if (pf->num != FUNC_MINOR ?
+		    ops[i].bar != pf->pchar->bar[pf->num].parent :
+		    !pf->pchar->bar[ops[i].bar].len)
+			return -EINVAL;
+
+		if (ops[i].cmd == PCHAR_OP_WRITE && !pf->writable)
+			return -EBADF;
+
+		bar = &pf->pchar->bar[pf_win(pf) ?: ops[i].bar];
+		err = bar_check_bounds(bar, ops[i].offset, 4);
+		if (!err)
+			err = policy_check(bar, ops[i].offset, 4,
+					   ops[i].cmd == PCHAR_OP_WRITE);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int ops_run(struct pci_char *pchar, unsigned int win,
+		   struct pchar_op *ops, size_t nr)
+{
+	struct bar_t *bar;
+	size_t i;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		bar = &pchar->bar[win ?: ops[i].bar];
+		if (ops[i].cmd == PCHAR_OP_READ) {
+			ops[i].value = bar_read32(bar, ops[i].offset);
+			err = dev_check(pchar, ops[i].value);
+			if (err)
+				return err;
+		} else {
+			bar_write32(bar, ops[i].offset, ops[i].value);
+		}
+	}
+
+	return 0;
+}
+
+static void job_free(struct exec_job *job)
+{
+	if (job->efd)
+		eventfd_ctx_put(job->efd);
+	if (job->src)
+		fput(job->src);
+	release_firmware(job->fw);
+	kvfree(job->buf);
+	kfree(job);
+}
+
+/* Read up to len bytes of the load source, short only at the end */
+static ssize_t load_read(struct exec_job *job, size_t len)
+{
+	ssize_t ret, bytes = 0;
+
+	while (bytes < len) {
+		ret = kernel_read(job->src, job->buf + bytes, len - bytes,
+				  &job->src_pos);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;
+		bytes += ret;
+	}
+
+	return bytes;
+}
+
+/*
+ * Stream one slice of an image into the BAR, either as burst into a
+ * window or as a string of 32 bit writes into a FIFO register. A
+ * trailing partial word is padded with zeros.
+ */
+static size_t load_run(struct bar_t *bar, struct exec_job *job)
+{
+	size_t n = min_t(size_t, job->len - job->done, EXEC_SLICE);
+	size_t words, tail;
+	const void *src;
+	ssize_t ret;
+	u32 last = 0;
+
+	if (job->fw) {
+		src = job->fw->data + job->done;
+	} else {
+		ret = load_read(job, n);
+		if (ret <= 0) {
+			job->status = ret ? ret : -EIO; /* file shrunk */
+			return 0;
+		}
+		n = ret;
+		src = job->buf;
+	}
+
+	job->crc = crc32_le(job->crc, src, n);
+
+	words = n / 4;
+	tail = n % 4;
+	if (tail)
+		memcpy(&last, src + words * 4, tail);
+
+	if (job->flags & PCHAR_LOAD_FIFO) {
+		iowrite32_rep(bar->addr + job->offset, src, words);
+		if (tail)
+			writel(last, bar->addr + job->offset);
+		bar_stat(bar, true, words + !!tail, n);
+	} else {
+		if (words)
+			bar_write_burst(bar, job->offset + job->done, src,
+					words * 4);
+		if (tail) {
+			writel(last, bar->addr + job->offset + job->done +
+			       words * 4);
+			bar_stat(bar, true, 1, tail);
+		}
+	}
+
+	return n;
+}
+
+/* Check the CRC of the image and optionally of what landed in the BAR */
+static void load_finish(struct bar_t *bar, struct exec_job *job)
+{
+	size_t n, done;
+	u32 crc = ~0;
+
+	job->crc = ~job->crc;
+	if (job->flags & PCHAR_LOAD_CRC && job->crc != job->expect_crc) {
+		job->status = -EBADMSG;
+		return;
+	}
+
+	if (!(job->flags & PCHAR_LOAD_VERIFY))
+		return;
+
+	for (done = 0; done < job->len; done += n) {
+		n = min_t(size_t, job->len - done, EXEC_SLICE);
+		memcpy_fromio(job->buf, bar->addr + job->offset + done, n);
+		crc = crc32_le(crc, job->buf, n);
+		cond_resched();
+	}
+
+	if (~crc != job->crc)
+		job->status = -EIO;
+}
+
+/* Run one slice of a job, returns true once it is complete */
+static bool job_run(struct pci_char *pchar, struct exec_job *job)
+{
+	struct bar_t *bar = &pchar->bar[job->num], *wbar;
+	unsigned int i;
+	size_t n;
+
+	switch (job->kind) {
+	case JOB_OPS:
+		n = min_t(size_t, job->len - job->done,
+			  EXEC_SLICE / sizeof(struct pchar_op));
+		job->status = ops_run(pchar, job->num,
+				      (struct pchar_op *)job->buf + job->done,
+				      n);
+		if (job->status)
+			return true;
+		break;
+	case JOB_BULK:
+		n = min_t(size_t, job->len - job->done, EXEC_SLICE);
+		bar_write_burst(bar, job->offset + job->done,
+				job->buf + job->done, n);
+		break;
+	case JOB_LOAD:
+		n = load_run(bar, job);
+		if (job->status)
+			return true;
+		break;
+	}
+
+	WRITE_ONCE(job->done, job->done + n);
+	if (job->done < job->len)
+		return false;
+
+	/* completion means the writes have reached the device */
+	for_each_set_bit(i, &job->written, FUNC_MINOR) {
+		wbar = &pchar->bar[i];
+		readl(wbar->addr + READ_ONCE(wbar->flush_off));
+	}
+
+	if (job->kind == JOB_LOAD)
+		load_finish(bar, job);
+
+	return true;
+}
+
+static int exec_thread(void *data)
+{
+	struct pci_char *pchar = data;
+	struct pchar_exec *ex = &pchar->exec;
+	struct eventfd_ctx *efd;
+	struct pchar_file *pf;
+	struct exec_job *job;
+	bool complete;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(ex->wq, !list_empty(&ex->active) ||
+					 kthread_should_stop());
+
+		spin_lock(&ex->lock);
+		if (list_empty(&ex->active)) {
+			spin_unlock(&ex->lock);
+			continue;
+		}
+		pf = list_first_entry(&ex->active, struct pchar_file,
+				      exec_node);
+		job = list_first_entry(&pf->jobs, struct exec_job, node);
+		ex->cur = pf;
+		spin_unlock(&ex->lock);
+
+		if (io_enter(pchar)) {
+			job->status = -ENODEV;
+			complete = true;
+		} else {
+			complete = job_run(pchar, job);
+			io_exit(pchar);
+		}
+
+		efd = NULL;
+		spin_lock(&ex->lock);
+		if (complete) {
+			list_move_tail(&job->node, &pf->done);
+			efd = job->efd; /* job may be reaped once unlocked */
+			job->efd = NULL;
+		}
+		if (!pf->closing) {
+			if (list_empty(&pf->jobs))
+				list_del_init(&pf->exec_node);
+			else
+				list_move_tail(&pf->exec_node, &ex->active);
+		}
+		spin_unlock(&ex->lock);
+
+		/* pf stays alive as long as it is ex->cur */
+		if (complete) {
+			wake_up_interruptible(&pf->done_wq);
+			if (efd) {
+				pchar_eventfd_signal(efd);
+				eventfd_ctx_put(efd);
+			}
+		}
+
+		spin_lock(&ex->lock);
+		ex->cur = NULL;
+		spin_unlock(&ex->lock);
+		wake_up(&ex->idle_wq);
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* The executor runs on the NUMA node the device is attached to */
+static int exec_start(struct pci_char *pchar, struct pci_dev *pdev)
+{
+	struct pchar_exec *ex = &pchar->exec;
+	int node = dev_to_node(&pdev->dev);
+
+	spin_lock_init(&ex->lock);
+	INIT_LIST_HEAD(&ex->active);
+	init_waitqueue_head(&ex->wq);
+	init_waitqueue_head(&ex->idle_wq);
+
+	ex->task = kthread_create_on_node(exec_thread, pchar, node,
+					  "pci-char/%02x:%02x.%x",
+					  pdev->bus->number,
+					  PCI_SLOT(pdev->devfn),
+					  PCI_FUNC(pdev->devfn));
+	if (IS_ERR(ex->task))
+		return PTR_ERR(ex->task);
+
+	if (node != NUMA_NO_NODE)
+		set_cpus_allowed_ptr(ex->task, cpumask_of_node(node));
+
+	wake_up_process(ex->task);
+
+	return 0;
+}
+
+static void exec_stop(struct pci_char *pchar)
+{
+	kthread_stop(pchar->exec.task);
+}
+
+/* After exec_stop() on remove: complete what is left with -ENODEV */
+static void exec_fail(struct pci_char *pchar)
+{
+	struct pchar_exec *ex = &pchar->exec;
+	struct pchar_file *pf, *tmp_pf;
+	struct exec_job *job, *tmp;
+
+	spin_lock(&ex->lock);
+	ex->stopped = true;
+	list_for_each_entry_safe(pf, tmp_pf, &ex->active, exec_node) {
+		list_for_each_entry_safe(job, tmp, &pf->jobs, node) {
+			job->status = -ENODEV;
+			list_move_tail(&job->node, &pf->done);
+			if (job->efd) {
+				pchar_eventfd_signal(job->efd);
+				eventfd_ctx_put(job->efd);
+				job->efd = NULL;
+			}
+		}
+		list_del_init(&pf->exec_node);
+		wake_up_interruptible(&pf->done_wq);
+	}
+	spin_unlock(&ex->lock);
+}
+
+/* Cancel queued jobs of a closing file and drop all of its jobs */
+static void exec_release(struct pchar_file *pf)
+{
+	struct pchar_exec *ex = &pf->pchar->exec;
+	struct exec_job *job, *tmp;
+
+	spin_lock(&ex->lock);
+	pf->closing = true;
+	list_del_init(&pf->exec_node);
+	spin_unlock(&ex->lock);
+
+	wait_event(ex->idle_wq, READ_ONCE(ex->cur) != pf);
+
+	list_for_each_entry_safe(job, tmp, &pf->jobs, node)
+		job_free(job);
+	list_for_each_entry_safe(job, tmp, &pf->done, node)
+		job_free(job);
+}
+
+/* Hand a prepared job to the executor and return its id */
+static int job_queue(struct pchar_file *pf, struct exec_job *job, s32 eventfd,
+		     u64 __user *uid)
+{
+	struct pchar_exec *ex = &pf->pchar->exec;
+
+	if (eventfd >= 0) {
+		job->efd = eventfd_ctx_fdget(eventfd);
+		if (IS_ERR(job->efd)) {
+			int err = PTR_ERR(job->efd);
+
+			job->efd = NULL;
+			job_free(job);
+			return err;
+		}
+	}
+
+	spin_lock(&ex->lock);
+	if (ex->stopped) {
+		spin_unlock(&ex->lock);
+		job_free(job);
+		return -ENODEV;
+	}
+	if (pf->nr_jobs == MAX_JOBS) {
+		spin_unlock(&ex->lock);
+		job_free(job);
+		return -EAGAIN;
+	}
+	pf->nr_jobs++;
+	job->id = ++ex->next_id;
+	list_add_tail(&job->node, &pf->jobs);
+	if (list_empty(&pf->exec_node))
+		list_add_tail(&pf->exec_node, &ex->active);
+	spin_unlock(&ex->lock);
+
+	wake_up(&ex->wq);
+
+	/* the id is only used for reaping, a fault just loses it */
+	return put_user(job->id, uid);
+}
+
+static long job_submit(struct pchar_file *pf, struct pchar_job __user *ujob)
+{
+	struct pchar_job args;
+	struct bar_t *bar;
+	struct exec_job *job;
+	size_t size;
+	int err;
+
+	if (copy_from_user(&args, ujob, sizeof(args)))
+		return -EFAULT;
+
+	if (args.flags & ~PCHAR_JOB_BULK || !args.len)
+		return -EINVAL;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+
+	job->num = pf_win(pf);
+	job->kind = args.flags & PCHAR_JOB_BULK ? JOB_BULK : JOB_OPS;
+	job->len = args.len;
+	job->offset = args.offset;
+
+	if (job->kind == JOB_BULK) {
+		err = -EBADF;
+		if (!pf->writable)
+			goto failure;
+		err = -EINVAL;
+		bar = pf_bar(pf, &job->offset);
+		if (!bar || args.len > MAX_JOB_LEN || args.len % 4 ||
+		    job->offset % 4 ||
+		    bar_check_bounds(bar, job->offset, args.len))
+			goto failure;
+		err = policy_check(bar, job->offset, args.len, true);
+		if (err)
+			goto failure;
+		job->num = bar_num(pf->pchar, bar);
+		size = args.len;
+	} else {
+		err = -E2BIG;
+		if (args.len > MAX_OPS)
+			goto failure;
+		size = args.len * sizeof(struct pchar_op);
+		job->uaddr = u64_to_user_ptr(args.data);
+	}
+
+	job->buf = vmemdup_user(u64_to_user_ptr(args.data), size);
+	if (IS_ERR(job->buf)) {
+		err = PTR_ERR(job->buf);
+		job->buf = NULL;
+		goto failure;
+	}
+
+	if (job->kind == JOB_OPS) {
+		err = ops_check(pf, job->buf, job->len);
+		if (err)
+			goto failure;
+		job->written = ops_written(pf, job->buf, job->len);
+	} else {
+		job->written = BIT(job->num);
+	}
+
+	return job_queue(pf, job, args.eventfd, &ujob->id);
+
+failure:
+	job_free(job);
+	return err;
+}
+
+/*
+ * Load an image from the firmware loader or from a regular file into
+ * a window or FIFO register of the BAR, executed as job.
+ */
+static long load_submit(struct pchar_file *pf, struct pchar_load __user *ul)
+{
+	struct pchar_load args;
+	struct exec_job *job;
+	struct bar_t *bar;
+	size_t span;
+	loff_t off;
+	int err;
+
+	if (!pf->writable)
+		return -EBADF;
+
+	if (copy_from_user(&args, ul, sizeof(args)))
+		return -EFAULT;
+
+	args.name[sizeof(args.name) - 1] = '\0';
+	off = args.offset;
+	bar = pf_bar(pf, &off);
+	if (!bar || args.flags & ~(PCHAR_LOAD_FIFO | PCHAR_LOAD_CRC |
+				   PCHAR_LOAD_VERIFY) || off % 4 ||
+	    (args.flags & PCHAR_LOAD_FIFO && args.flags & PCHAR_LOAD_VERIFY))
+		return -EINVAL;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+
+	job->num = bar_num(pf->pchar, bar);
+	job->written = BIT(job->num);
+	job->kind = JOB_LOAD;
+	job->offset = off;
+	job->flags = args.flags;
+	job->expect_crc = args.crc;
+	job->crc = ~0;
+
+	if (args.name[0]) {
+		err = request_firmware(&job->fw, args.name,
+				       &pf->pchar->pdev->dev);
+		if (err)
+			goto failure;
+		job->len = job->fw->size;
+	} else {
+		err = -EBADF;
+		job->src = fget(args.fd);
+		if (!job->src)
+			goto failure;
+		err = -EINVAL;
+		if (!S_ISREG(file_inode(job->src)->i_mode))
+			goto failure;
+		job->len = i_size_read(file_inode(job->src));
+	}
+
+	err = -EINVAL;
+	if (!job->len)
+		goto failure;
+
+	/* a FIFO is a single register, a window takes the whole image */
+	span = args.flags & PCHAR_LOAD_FIFO ? 4 : ALIGN(job->len, 4);
+	if (bar_check_bounds(bar, off, span))
+		goto failure;
+	err = policy_check(bar, off, span, true);
+	if (err)
+		goto failure;
+
+	if (job->src || args.flags & PCHAR_LOAD_VERIFY) {
+		err = -ENOMEM;
+		job->buf = kvmalloc(EXEC_SLICE, GFP_KERNEL);
+		if (!job->buf)
+			goto failure;
+	}
+
+	return job_queue(pf, job, args.eventfd, &ul->id);
+
+failure:
+	job_free(job);
+	return err;
+}
+
+/* Progress of a queued, running or completed job */
+static long job_status(struct pchar_file *pf,
+		       struct pchar_job_status __user *us)
+{
+	struct pchar_exec *ex = &pf->pchar->exec;
+	struct pchar_job_status st;
+	struct exec_job *job;
+	int err = -ENOENT;
+
+	if (copy_from_user(&st, us, sizeof(st)))
+		return -EFAULT;
+
+	spin_lock(&ex->lock);
+	list_for_each_entry(job, &pf->jobs, node)
+		if (job->id == st.id) {
+			st.done = READ_ONCE(job->done);
+			st.len = job->len;
+			st.crc = 0;
+			st.complete = 0;
+			err = 0;
+		}
+	list_for_each_entry(job, &pf->done, node)
+		if (job->id == st.id) {
+			st.done = job->done;
+			st.len = job->len;
+			st.crc = job->kind == JOB_LOAD ? job->crc : 0;
+			st.complete = 1;
+			err = 0;
+		}
+	spin_unlock(&ex->lock);
+
+	if (!err && copy_to_user(us, &st, sizeof(st)))
+		err = -EFAULT;
+
+	return err;
+}
+
+/* Find a completed job, id 0 matches any. Called with exec.lock held */
+static struct exec_job *job_find_done(struct pchar_file *pf, u64 id,
+				      bool *pending)
+{
+	struct exec_job *job;
+
+	list_for_each_entry(job, &pf->done, node)
+		if (!id || job->id == id)
+			return job;
+
+	*pending = false;
+	list_for_each_entry(job, &pf->jobs, node)
+		if (!id || job->id == id)
+			*pending = true;
+
+	return NULL;
+}
+
+static bool job_ready(struct pchar_file *pf, u64 id)
+{
+	struct pchar_exec *ex = &pf->pchar->exec;
+	struct exec_job *job;
+	bool pending;
+
+	spin_lock(&ex->lock);
+	job = job_find_done(pf, id, &pending);
+	spin_unlock(&ex->lock);
+
+	return job || !pending;
+}
+
+static long job_wait(struct pchar_file *pf, struct pchar_job_wait __user *uw)
+{
+	struct pchar_exec *ex = &pf->pchar->exec;
+	struct pchar_job_wait w;
+	struct exec_job *job;
+	bool pending;
+	int err;
+
+	if (copy_from_user(&w, uw, sizeof(w)))
+		return -EFAULT;
+
+	if (w.flags & ~PCHAR_WAIT_NONBLOCK)
+		return -EINVAL;
+
+	for (;;) {
+		spin_lock(&ex->lock);
+		job = job_find_done(pf, w.id, &pending);
+		if (job) {
+			list_del(&job->node);
+			pf->nr_jobs--;
+		}
+		spin_unlock(&ex->lock);
+
+		if (job)
+			break;
+		if (!pending)
+			return -ENOENT;
+		if (w.flags & PCHAR_WAIT_NONBLOCK)
+			return -EAGAIN;
+
+		err = wait_event_interruptible(pf->done_wq,
+					       job_ready(pf, w.id));
+		if (err)
+			return err;
+	}
+
+	w.id = job->id;
+	w.status = job->status;
+	err = 0;
+	if (job->kind == JOB_OPS && copy_to_user(job->uaddr, job->buf,
+				       job->len * sizeof(struct pchar_op)))
+		err = -EFAULT;
+	job_free(job);
+
+	if (!err && copy_to_user(uw, &w, sizeof(w)))
+		err = -EFAULT;
+
+	return err;
+}
+
+/* Synchronous variant of an ops job, executed in the caller's context */
+static long dev_batch(struct pchar_file *pf, struct pchar_batch __user *ub)
+{
+	struct pchar_batch b;
+	struct pchar_op *ops;
+	size_t size, i;
+	int err;
+
+	if (copy_from_user(&b, ub, sizeof(b)))
+		return -EFAULT;
+
+	if (b.nr_ops > MAX_OPS)
+		return -E2BIG;
+
+	size = b.nr_ops * sizeof(*ops);
+	ops = vmemdup_user(u64_to_user_ptr(b.ops), size);
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	err = ops_check(pf, ops, b.nr_ops);
+	if (!err) {
+		err = ops_run(pf->pchar, pf_win(pf), ops, b.nr_ops);
+		for (i = 0; i < b.nr_ops; i++)
+			if (ops[i].cmd == PCHAR_OP_WRITE)
+				mark_dirty(pf, pf_win(pf) ?: ops[i].bar);
+		if (!err && copy_to_user(u64_to_user_ptr(b.ops), ops, size))
+			err = -EFAULT;
+	}
+
+	kvfree(ops);
+	return err;
+}
+
+/* Mapped stream register, NULL if the device does not have it */
+static int stream_reg(struct pchar_file *pf, u64 offset, bool write,
+		      void __iomem **reg)
+{
+	struct bar_t *bar;
+	loff_t off = offset;
+	int err;
+
+	*reg = NULL;
+	if (offset == PCHAR_CAPTURE_NO_REG)
+		return 0;
+
+	bar = pf_bar(pf, &off);
+	if (!bar || off % 4 || bar_check_bounds(bar, off, 4))
+		return -EINVAL;
+
+	err = policy_check(bar, off, 4, write);
+	if (err)
+		return err;
+
+	*reg = bar->addr + off;
+	return 0;
+}
+
+/* Hand the index advanced by user space to device and status page */
+static void stream_sw_out(struct pchar_stream *s)
+{
+	WRITE_ONCE(*s->sw_st, s->sw_idx);
+	if (s->sw)
+		writel(s->sw_idx, s->sw);
+}
+
+static void stream_flag(struct pchar_stream *s, u32 flag, bool on)
+{
+	u32 flags = READ_ONCE(*s->flags_st) & ~flag;
+
+	WRITE_ONCE(*s->flags_st, flags | (on ? flag : 0));
+}
+
+/*
+ * A producer more than the ring size ahead has overwritten unread
+ * data, which is dropped as a whole. A full ring is counted once per
+ * time it fills up.
+ */
+static u32 capture_avail(struct pchar_stream *s, u32 prod)
+{
+	struct pchar_capture_status *st = s->cs;
+	u32 fill = prod - s->sw_idx;
+
+	if (fill > s->size) {
+		WRITE_ONCE(st->overflows, st->overflows + 1);
+		WRITE_ONCE(st->lost, st->lost + fill);
+		s->sw_idx = prod;
+		stream_sw_out(s);
+		fill = 0;
+	}
+
+	if (fill == s->size && !s->edge)
+		WRITE_ONCE(st->full, st->full + 1);
+	s->edge = fill == s->size;
+	stream_flag(s, PCHAR_CAPTURE_FULL, s->edge);
+
+	return fill;
+}
+
+/* A running device that drained the ring is counted once per time */
+static u32 playback_avail(struct pchar_stream *s, u32 cons)
+{
+	struct pchar_playback_status *st = s->ps;
+	u32 queued = s->sw_idx - cons;
+
+	/* a consumer ahead of the producer is bogus, take it as drained */
+	if (queued > s->size)
+		queued = 0;
+
+	if (!queued && !s->edge && READ_ONCE(st->flags) & PCHAR_STREAM_RUNNING)
+		WRITE_ONCE(st->underruns, st->underruns + 1);
+	s->edge = !queued;
+	stream_flag(s, PCHAR_PLAYBACK_EMPTY, s->edge);
+
+	return s->size - queued;
+}
+
+/* Bytes user space can take over: data to read or space to fill */
+static u32 stream_avail(struct pchar_stream *s)
+{
+	u32 hw;
+
+	lockdep_assert_held(&s->lock);
+
+	/* a device in reset reads all ones, keep the last value */
+	if (s->hw && READ_ONCE(*s->state) == DEV_LIVE) {
+		hw = readl(s->hw);
+		WRITE_ONCE(*s->hw_st, hw);
+	} else {
+		hw = READ_ONCE(*s->hw_st);
+	}
+	this_cpu_add(s->stats->ev[EV_DMA_BYTES], (u32)(hw - s->hw_idx));
+	s->hw_idx = hw;
+
+	return s->tx ? playback_avail(s, hw) : capture_avail(s, hw);
+}
+
+static bool stream_ready(struct pchar_stream *s)
+{
+	unsigned long flags;
+	u32 avail;
+
+	spin_lock_irqsave(&s->lock, flags);
+	avail = stream_avail(s);
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	return avail && avail >= s->watermark;
+}
+
+static enum hrtimer_restart stream_timer(struct hrtimer *timer)
+{
+	struct pchar_stream *s = container_of(timer, struct pchar_stream,
+					      timer);
+
+	if (stream_ready(s))
+		wake_up_all(&s->timer_wq);
+
+	hrtimer_forward_now(timer, s->period);
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Stop the device, the ring stays mapped. Only callers holding the
+ * io_rwsem gate tell the device, in reset or gone it stopped already.
+ */
+static void stream_halt(struct pchar_stream *s, bool live)
+{
+	if (!s->running)
+		return;
+
+	if (live) {
+		writel(0, s->ctrl);
+		readl(s->ctrl);		/* flush the posted write */
+	}
+	if (s->wq == &s->timer_wq)
+		hrtimer_cancel(&s->timer);
+	s->running = false;
+
+	spin_lock_irq(&s->lock);
+	stream_flag(s, PCHAR_STREAM_RUNNING, false);
+	spin_unlock_irq(&s->lock);
+}
+
+static void stream_free(struct pchar_stream *s, bool live)
+{
+	if (!s)
+		return;
+
+	stream_halt(s, live);
+	if (s->status)
+		dma_free_coherent(s->dev, PAGE_SIZE, s->status, s->status_dma);
+	if (s->ring)
+		dma_free_coherent(s->dev, s->size, s->ring, s->ring_dma);
+	kfree(s);
+}
+
+/*
+ * On remove, with the device dead: the stream never touches it again,
+ * the ring stays until its file is released.
+ */
+static void stream_detach(struct pchar_stream *s, bool live)
+{
+	if (!s)
+		return;
+
+	stream_halt(s, live);
+
+	/* wait out a stream_avail() that saw the device live */
+	spin_lock_irq(&s->lock);
+	spin_unlock_irq(&s->lock);
+}
+
+/* 64 bit bus address into a register pair, hi may be missing */
+static int stream_write_addr(dma_addr_t addr, void __iomem *lo,
+			     void __iomem *hi)
+{
+	if (upper_32_bits(addr) && !hi)
+		return -ENOMEM;
+
+	writel(lower_32_bits(addr), lo);
+	if (hi)
+		writel(upper_32_bits(addr), hi);
+	return 0;
+}
+
+/*
+ * A ring lives as long as the file, so that it can still be drained
+ * after it is stopped and cannot go away while it is mapped. The
+ * device advances hw_reg, or writes it back, user space sw_reg.
+ */
+static long stream_start(struct pchar_file *pf, struct pchar_stream **slot,
+			 bool tx, const struct stream_cfg *c)
+{
+	struct pci_char *pchar = pf->pchar;
+	struct device *dev = &pchar->pdev->dev;
+	void __iomem *base_lo, *base_hi, *size_reg, *wb_lo, *wb_hi;
+	struct pchar_stream *s;
+	int err;
+
+	if (!pf->writable)
+		return -EBADF;
+
+	if (c->size < PAGE_SIZE || c->size > STREAM_MAX ||
+	    !is_power_of_2(c->size) || c->watermark > c->size)
+		return -EINVAL;
+
+	if (c->vector != PCHAR_WAIT_NO_IRQ && c->vector >= pchar->nr_irqs)
+		return -EINVAL;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	s->dev = dev;
+	s->stats = pchar->stats;
+	s->state = &pchar->state;
+	s->tx = tx;
+	s->size = c->size;
+	s->unit = c->unit;
+	s->watermark = c->watermark;
+	spin_lock_init(&s->lock);
+	init_waitqueue_head(&s->timer_wq);
+
+	err = stream_reg(pf, c->base_lo, true, &base_lo) ?:
+	      stream_reg(pf, c->base_hi, true, &base_hi) ?:
+	      stream_reg(pf, c->size_reg, true, &size_reg) ?:
+	      stream_reg(pf, c->hw_reg, false, &s->hw) ?:
+	      stream_reg(pf, c->sw_reg, true, &s->sw) ?:
+	      stream_reg(pf, c->wb_lo, true, &wb_lo) ?:
+	      stream_reg(pf, c->wb_hi, true, &wb_hi) ?:
+	      stream_reg(pf, c->ctrl_reg, true, &s->ctrl);
+	if (err)
+		goto failure;
+
+	if (c->writeback)
+		s->hw = NULL;
+	/* a playback device has to learn about new data */
+	if (!base_lo || !s->ctrl || (tx && !s->sw) ||
+	    (c->writeback ? !wb_lo : !s->hw)) {
+		err = -EINVAL;
+		goto failure;
+	}
+
+	err = -ENOMEM;
+	s->ring = dma_alloc_coherent(dev, s->size, &s->ring_dma,
+				     GFP_KERNEL | __GFP_NOWARN);
+	if (!s->ring)
+		goto failure;
+
+	s->status = dma_alloc_coherent(dev, PAGE_SIZE, &s->status_dma,
+				       GFP_KERNEL);
+	if (!s->status)
+		goto failure;
+
+	if (tx) {
+		s->hw_st = &s->ps->consumer;
+		s->sw_st = &s->ps->producer;
+		s->flags_st = &s->ps->flags;
+		s->edge = true;		/* starts out drained */
+	} else {
+		s->hw_st = &s->cs->producer;
+		s->sw_st = &s->cs->consumer;
+		s->flags_st = &s->cs->flags;
+	}
+
+	mutex_lock(&pf->lock);
+	if (*slot) {
+		err = -EBUSY;
+		goto failure_unlock;
+	}
+
+	err = stream_write_addr(s->ring_dma, base_lo, base_hi);
+	if (!err && wb_lo)
+		err = stream_write_addr(s->status_dma +
+					((void *)s->hw_st - s->status),
+					wb_lo, wb_hi);
+	if (err)
+		goto failure_unlock;
+
+	if (size_reg)
+		writel(s->size, size_reg);
+	stream_sw_out(s);
+
+	if (c->vector != PCHAR_WAIT_NO_IRQ) {
+		s->wq = &pchar->irq[c->vector].wq;
+	} else {
+		s->wq = &s->timer_wq;
+		s->period = us_to_ktime(max_t(u32, c->poll_us, WAIT_POLL_MIN));
+		pchar_hrtimer_setup(&s->timer, stream_timer, CLOCK_MONOTONIC,
+				    HRTIMER_MODE_REL);
+	}
+
+	pci_set_master(pchar->pdev);
+	WRITE_ONCE(*s->flags_st, PCHAR_STREAM_RUNNING |
+		   (tx ? PCHAR_PLAYBACK_EMPTY : 0));
+	s->running = true;
+	writel(c->ctrl_enable, s->ctrl);
+	if (s->wq == &s->timer_wq)
+		hrtimer_start(&s->timer, s->period, HRTIMER_MODE_REL);
+
+	smp_store_release(slot, s);
+	mutex_unlock(&pf->lock);
+
+	return 0;
+
+failure_unlock:
+	mutex_unlock(&pf->lock);
+failure:
+	stream_free(s, true);
+	return err;
+}
+
+static long capture_start(struct pchar_file *pf,
+			  struct pchar_capture __user *uc)
+{
+	struct pchar_capture c;
+	struct stream_cfg cfg;
+
+	if (copy_from_user(&c, uc, sizeof(c)))
+		return -EFAULT;
+
+	if (c.flags & ~PCHAR_CAPTURE_WRITEBACK || c.size > STREAM_MAX)
+		return -EINVAL;
+
+	cfg = (struct stream_cfg) {
+		.size = c.size,
+		.unit = 1,
+		.watermark = c.watermark,
+		.writeback = c.flags & PCHAR_CAPTURE_WRITEBACK,
+		.vector = c.vector,
+		.poll_us = c.poll_us,
+		.ctrl_enable = c.ctrl_enable,
+		.base_lo = c.base_lo,
+		.base_hi = c.base_hi,
+		.size_reg = c.size_reg,
+		.hw_reg = c.prod_reg,
+		.sw_reg = c.cons_reg,
+		.wb_lo = c.wb_lo,
+		.wb_hi = c.wb_hi,
+		.ctrl_reg = c.ctrl_reg,
+	};
+
+	return stream_start(pf, &pf->capture, false, &cfg);
+}
+
+static long playback_start(struct pchar_file *pf,
+			   struct pchar_playback __user *up)
+{
+	struct pchar_playback p;
+	struct stream_cfg cfg;
+
+	if (copy_from_user(&p, up, sizeof(p)))
+		return -EFAULT;
+
+	if (p.flags & ~PCHAR_PLAYBACK_WRITEBACK ||
+	    !is_power_of_2(p.nr_buffers) || !is_power_of_2(p.buffer_size) ||
+	    p.watermark > p.nr_buffers ||
+	    (u64)p.nr_buffers * p.buffer_size > STREAM_MAX)
+		return -EINVAL;
+
+	cfg = (struct stream_cfg) {
+		.size = (size_t)p.nr_buffers * p.buffer_size,
+		.unit = p.buffer_size,
+		.watermark = p.watermark * p.buffer_size,
+		.writeback = p.flags & PCHAR_PLAYBACK_WRITEBACK,
+		.vector = p.vector,
+		.poll_us = p.poll_us,
+		.ctrl_enable = p.ctrl_enable,
+		.base_lo = p.base_lo,
+		.base_hi = p.base_hi,
+		.size_reg = p.size_reg,
+		.hw_reg = p.cons_reg,
+		.sw_reg = p.prod_reg,
+		.wb_lo = p.wb_lo,
+		.wb_hi = p.wb_hi,
+		.ctrl_reg = p.ctrl_reg,
+	};
+
+	return stream_start(pf, &pf->playback, true, &cfg);
+}
+
+static long stream_stop(struct pchar_file *pf, struct pchar_stream **slot)
+{
+	struct pchar_stream *s = smp_load_acquire(slot);
+
+	if (!s)
+		return -ENXIO;
+
+	mutex_lock(&pf->lock);
+	stream_halt(s, true);
+	mutex_unlock(&pf->lock);
+
+	return 0;
+}
+
+/*
+ * Hand units back to the device, read bytes of a capture or filled
+ * buffers of a playback. The new index is written to the device.
+ */
+static long stream_advance(struct pchar_stream **slot, u32 __user *unr)
+{
+	struct pchar_stream *s = smp_load_acquire(slot);
+	long err = 0;
+	u64 bytes;
+	u32 nr;
+
+	if (!s)
+		return -ENXIO;
+
+	if (get_user(nr, unr))
+		return -EFAULT;
+
+	bytes = (u64)nr * s->unit;
+	spin_lock_irq(&s->lock);
+	if (bytes > stream_avail(s)) {
+		err = -EINVAL;
+	} else {
+		s->sw_idx += bytes;
+		stream_sw_out(s);
+		stream_avail(s);
+	}
+	spin_unlock_irq(&s->lock);
+
+	return err;
+}
+
+/* Status pages are read-only, so is the ring of a capture */
+static int stream_mmap(struct pchar_stream **slot, struct vm_area_struct *vma,
+		       bool ring)
+{
+	struct pchar_stream *s = smp_load_acquire(slot);
+
+	if (!s)
+		return -ENXIO;
+
+	if (!ring || !s->tx) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		pchar_vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
+	vma->vm_pgoff = 0;
+	if (ring)
+		return dma_mmap_coherent(s->dev, vma, s->ring, s->ring_dma,
+					 s->size);
+
+	return dma_mmap_coherent(s->dev, vma, s->status, s->status_dma,
+				 PAGE_SIZE);
+}
+
+/* The page is only freed once the last mapping of it is gone */
+static int status_mmap(struct pci_char *pchar, struct vm_area_struct *vma)
+{
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	pchar_vm_flags_clear(vma, VM_MAYWRITE);
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(pchar->status));
+}
+
+/*
+ * Completed jobs and capture data past the watermark are readable,
+ * playback is writable with free buffers past its watermark. A device
+ * in error recovery reports priority data, a dead one hangs up.
+ */
+static __poll_t dev_poll(struct file *file, poll_table *wait)
+{
+	struct pchar_file *pf = file->private_data;
+	struct pchar_stream *cap = smp_load_acquire(&pf->capture);
+	struct pchar_stream *play = smp_load_acquire(&pf->playback);
+	__poll_t mask = 0;
+
+	poll_wait(file, &pf->done_wq, wait);
+	poll_wait(file, &pf->pchar->state_wq, wait);
+	if (cap)
+		poll_wait(file, cap->wq, wait);
+	if (play && (!cap || play->wq != cap->wq))
+		poll_wait(file, play->wq, wait);
+
+	if (!list_empty_careful(&pf->done))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (cap && stream_ready(cap))
+		mask |= EPOLLIN | EPOLLRDBAND;
+	if (play && stream_ready(play))
+		mask |= EPOLLOUT | EPOLLWRBAND;
+	if (READ_ONCE(pf->pchar->state) != DEV_LIVE)
+		mask |= EPOLLPRI;
+	if (READ_ONCE(pf->pchar->state) == DEV_DEAD)
+		mask |= EPOLLERR | EPOLLHUP;
+
+	return mask;
+}
+
+/* Last reference gone: nothing reaches the device or its files any more */
+static void pchar_free(struct kref *ref)
+{
+	struct pci_char *pchar = container_of(ref, struct pci_char, ref);
+	unsigned int i;
+
+	for (i = 0; i < FUNC_MINOR; i++) {
+		kfree(rcu_access_pointer(pchar->bar[i].policy));
+		cache_free(rcu_access_pointer(pchar->bar[i].cache));
+	}
+	kfree(pchar->irq);
+	if (pchar->err_efd)
+		eventfd_ctx_put(pchar->err_efd);
+	free_page((unsigned long)pchar->status);
+	free_percpu(pchar->stats);
+	pci_dev_put(pchar->pdev);
+	kfree(pchar);
+}
+
+/* The device behind a node, with a reference, or NULL once removed */
+static struct pci_char *pchar_get(unsigned int major)
+{
+	struct pci_char *pchar;
+
+	mutex_lock(&pchar_list_lock);
+	list_for_each_entry(pchar, &pchar_list, node) {
+		if (pchar->major == major) {
+			kref_get(&pchar->ref);
+			mutex_unlock(&pchar_list_lock);
+			return pchar;
+		}
+	}
+	mutex_unlock(&pchar_list_lock);
+
+	return NULL;
+}
+
+static int dev_open(struct inode *inode, struct file *file)
+{
+	unsigned int num = iminor(file->f_path.dentry->d_inode);
+	struct pci_char *pchar;
+	struct pchar_file *pf;
+	int err;
+
+	if (num > FUNC_MINOR)
+		return -ENXIO;
+
+	pchar = pchar_get(imajor(inode));
+	if (!pchar)
+		return -ENODEV;
+
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf) {
+		err = -ENOMEM;
+		goto failure_alloc;
+	}
+
+	/* sub-windows come and go, an open one cannot be removed */
+	mutex_lock(&pchar->cfg_lock);
+	if (num != FUNC_MINOR) {
+		if (pchar->bar[num].len == 0) {
+			mutex_unlock(&pchar->cfg_lock);
+			err = -EIO; /* BAR not in use or not memory type */
+			goto failure_bar;
+		}
+		pchar->bar[num].users++;
+	}
+	mutex_unlock(&pchar->cfg_lock);
+
+	pf->pchar = pchar;
+	pf->num = num;
+	pf->writable = file->f_mode & FMODE_WRITE;
+	mutex_init(&pf->lock);
+	INIT_LIST_HEAD(&pf->exec_node);
+	INIT_LIST_HEAD(&pf->jobs);
+	INIT_LIST_HEAD(&pf->done);
+	init_waitqueue_head(&pf->done_wq);
+
+	/* remembered for zapping user mappings on policy changes */
+	if (num == FUNC_MINOR)
+		pchar->func_mapping = file->f_mapping;
+	else
+		pchar->bar[num].mapping = file->f_mapping;
+	file->private_data = pf;
+
+	/* remove reaches the streams of open files through here */
+	mutex_lock(&pchar->files_lock);
+	list_add(&pf->node, &pchar->files);
+	mutex_unlock(&pchar->files_lock);
+
+	return 0;
+
+failure_bar:
+	kfree(pf);
+failure_alloc:
+	kref_put(&pchar->ref, pchar_free);
+	return err;
+};
+
+/*
+ * Writes are posted, so only a read from the same BAR guarantees that
+ * they have reached the device. One read per written BAR covers any
+ * number of writes, and files that did not write skip the round trip.
+ */
+static int dev_flush(struct file *file, fl_owner_t id)
+{
+	struct pchar_file *pf = file->private_data;
+	struct bar_t *bar;
+	unsigned int i;
+	int err;
+
+	if (!READ_ONCE(pf->dirty) && !READ_ONCE(pf->stage_len))
+		return 0;
+
+	/* close() must not hang on a reset, lost writes are lost anyway */
+	if (id) {
+		if (!io_try(pf->pchar))
+			return 0;
+	} else {
+		err = io_enter(pf->pchar);
+		if (err)
+			return err;
+	}
+
+	mutex_lock(&pf->lock);
+	stage_flush(pf);
+	for_each_set_bit(i, &pf->dirty, FUNC_MINOR) {
+		bar = &pf->pchar->bar[i];
+		readl(bar->addr + READ_ONCE(bar->flush_off));
+		clear_bit(i, &pf->dirty);
+	}
+	mutex_unlock(&pf->lock);
+
+	io_exit(pf->pchar);
+	return 0;
+}
+
+static int dev_fsync(struct file *file, loff_t start, loff_t end,
+		     int datasync)
+{
+	return dev_flush(file, NULL);
+}
+
+static int dev_release(struct inode *inode, struct file *file)
+{
+	struct pchar_file *pf = file->private_data;
+	struct pci_char *pchar = pf->pchar;
+	bool live;
+
+	exec_release(pf);
+
+	/* staged writes to a device in reset or gone are lost anyway */
+	live = io_try(pchar);
+	mutex_lock(&pf->lock);
+	if (live)
+		stage_flush(pf);
+	stream_free(pf->capture, live);
+	stream_free(pf->playback, live);
+	pf->capture = NULL;
+	pf->playback = NULL;
+	mutex_unlock(&pf->lock);
+	if (live)
+		io_exit(pchar);
+	kvfree(pf->stage_buf);
+
+	/* only now, remove has to see streams that may still run */
+	mutex_lock(&pchar->files_lock);
+	list_del(&pf->node);
+	mutex_unlock(&pchar->files_lock);
+
+	if (pf->num != FUNC_MINOR) {
+		mutex_lock(&pchar->cfg_lock);
+		pchar->bar[pf->num].users--;
+		mutex_unlock(&pchar->cfg_lock);
+	}
+	kfree(pf);
+	kref_put(&pchar->ref, pchar_free);
+
+	return 0;
+}
+
+/*
+ * Positioning is lockless like for other fixed size devices, relative
+ * positions are resolved here only to enforce the alignment.
+ */
+static loff_t seek_aligned(struct file *file, loff_t offset, int whence,
+			   loff_t size)
+{
+	loff_t new_pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		new_pos = offset;
+		break;
+	case SEEK_CUR:
+		new_pos = READ_ONCE(file->f_pos) + offset;
+		break;
+	case SEEK_END:
+		new_pos = size + offset;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (new_pos % 4)
+		return -EINVAL; /* Only allow 4 byte alignment */
+
+	return fixed_size_llseek(file, new_pos, SEEK_SET, size);
+}
+
+static loff_t dev_seek(struct file *file, loff_t offset, int whence)
+{
+	struct pchar_file *pf = file->private_data;
+
+	/* the func device spans the windows of all six BARs */
+	if (pf->num == FUNC_MINOR)
+		return seek_aligned(file, offset, whence,
+				    6ULL << PCHAR_FUNC_BAR_SHIFT);
+
+	return seek_aligned(file, offset, whence,
+			    pf->pchar->bar[pf->num].len);
+}
+
+static ssize_t bar_rw_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	struct pchar_file *pf = file->private_data;
+	u32 __user *tmp = (u32 __user *) buf;
+	u32 data;
+	loff_t pos = *ppos, offset = pos;
+	struct bar_t *bar;
+	int err = 0;
+	ssize_t bytes = 0;
+
+	bar = pf_bar(pf, &offset);
+	if (!bar)
+		return -EINVAL;
+
+	err = rw_check(bar, offset, count, false);
+	if (err)
+		return err;
+
+	/* read after write hazard on staged data */
+	if (READ_ONCE(pf->stage_len)) {
+		mutex_lock(&pf->lock);
+		if (pos < pf->stage_off + pf->stage_len &&
+		    pf->stage_off < pos + count)
+			stage_flush(pf);
+		mutex_unlock(&pf->lock);
+	}
+
+	/* whole lines in one go, the rest word by word */
+	if (wc_usable(bar, offset, count, false)) {
+		bytes = wc_copy(bar, offset, buf, count, false, &err);
+		tmp += bytes / 4;
+		offset += bytes;
+		count -= bytes;
+	}
+
+	for (; count && !err; count -= 4) {
+		data = bar_read32(bar, offset);
+		err = dev_check(pf->pchar, data);
+		if (err)
+			break;
+		if (copy_to_user(tmp, &data, 4)) {
+			err = -EFAULT;
+			break;
+		}
+		tmp += 1;
+		offset += 4;
+		bytes += 4;
+		if (!(bytes % RW_SLICE))
+			cond_resched();
+	}
+
+	atomic64_add(bytes, &bar->rd_bytes);
+	*ppos += bytes;
+	return bytes ? bytes : err;
+};
+
+static ssize_t bar_rw_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct pchar_file *pf = file->private_data;
+	const u32 __user *tmp = (const u32 __user *)buf;
+	u32 data;
+	loff_t offset = *ppos;
+	struct bar_t *bar;
+	int err = 0;
+	ssize_t bytes = 0;
+
+	bar = pf_bar(pf, &offset);
+	if (!bar)
+		return -EINVAL;
+
+	err = rw_check(bar, offset, count, true);
+	if (err)
+		return err;
+
+	mark_dirty(pf, bar_num(pf->pchar, bar));
+
+	if (READ_ONCE(pf->staging)) {
+		mutex_lock(&pf->lock);
+		if (pf->staging) {
+			/* staged at the file position, it carries the BAR */
+			bytes = stage_write(pf, buf, count, *ppos);
+			mutex_unlock(&pf->lock);
+			if (bytes > 0) {
+				atomic64_add(bytes, &bar->wr_bytes);
+				*ppos += bytes;
+			}
+			return bytes;
+		}
+		mutex_unlock(&pf->lock);
+	}
+
+	if (wc_usable(bar, offset, count, true)) {
+		bytes = wc_copy(bar, offset, (void __user *)buf, count, true,
+				&err);
+		tmp += bytes / 4;
+		offset += bytes;
+		count -= bytes;
+	}
+
+	for (; count && !err; count -= 4) {
+		if (copy_from_user(&data, tmp, 4)) {
+			err = -EFAULT;
+			break;
+		}
+		bar_write32(bar, offset, data);
+		tmp += 1;
+		offset += 4;
+		bytes += 4;
+		if (!(bytes % RW_SLICE))
+			cond_resched();
+	}
+
+	atomic64_add(bytes, &bar->wr_bytes);
+	*ppos += bytes;
+	return bytes ? bytes : err;
+};
+
+static ssize_t dev_read(struct file *file, char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	struct pchar_file *pf = file->private_data;
+	ssize_t ret;
+
+	ret = io_enter(pf->pchar);
+	if (ret)
+		return ret;
+
+	ret = bar_rw_read(file, buf, count, ppos);
+	io_exit(pf->pchar);
+	return ret;
+}
+
+static ssize_t dev_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	struct pchar_file *pf = file->private_data;
+	ssize_t ret;
+
+	ret = io_enter(pf->pchar);
+	if (ret)
+		return ret;
+
+	ret = bar_rw_write(file, buf, count, ppos);
+	io_exit(pf->pchar);
+	return ret;
+}
+
+/*
+ * Pages are inserted on fault, so that the policy is evaluated for
+ * every single page and only permitted pages ever get mapped. Where
+ * the kernel supports PFN maps at PMD/PUD level, whole 2M/1G blocks
+ * are inserted if both addresses are aligned and the policy permits
+ * the whole block, else the fault falls back to the next smaller size.
+ *
+ * Faults of user space pause during error recovery like system calls.
+ * Those of the kernel may come from within one, which already holds
+ * off recovery, so they only check that the device is still there.
+ */
+static vm_fault_t bar_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct pchar_file *pf = vma->vm_file->private_data;
+	struct pci_char *pchar = pf->pchar;
+	bool user = vmf->flags & FAULT_FLAG_USER;
+	struct bar_t *bar = vma->vm_private_data;
+	size_t size = PAGE_SIZE << order;
+	unsigned long addr = vmf->address & ~(size - 1);
+	loff_t off = (((loff_t)vma->vm_pgoff << PAGE_SHIFT) & FUNC_OFF_MASK) +
+		     (addr - vma->vm_start);
+	unsigned long pfn = (bar->phys + off) >> PAGE_SHIFT;
+	vm_fault_t ret = VM_FAULT_FALLBACK;
+	int level = 0;
+
+	if (order && (addr < vma->vm_start || addr + size > vma->vm_end ||
+		      pfn & ((1UL << order) - 1)))
+		return VM_FAULT_FALLBACK;
+
+	if (off >= bar->len || (order && size > bar->len - off) ||
+	    !policy_map_ok(bar, off, size, vma->vm_flags & VM_WRITE))
+		return order ? VM_FAULT_FALLBACK : VM_FAULT_SIGBUS;
+
+	if (user ? io_enter(pchar) : READ_ONCE(pchar->state) == DEV_DEAD)
+		return VM_FAULT_SIGBUS;
+
+	switch (order) {
+	case 0:
+		ret = vmf_insert_pfn(vma, vmf->address, pfn);
+		break;
+#ifdef PCHAR_HUGE_PFNMAP
+	case PMD_ORDER:
+		ret = pchar_insert_pfn_pmd(vmf, pfn,
+					   vmf->flags & FAULT_FLAG_WRITE);
+		level = 1;
+		break;
+#ifdef CONFIG_ARCH_SUPPORTS_PUD_PFNMAP
+	case PUD_ORDER:
+		ret = pchar_insert_pfn_pud(vmf, pfn,
+					   vmf->flags & FAULT_FLAG_WRITE);
+		level = 2;
+		break;
+#endif
+#endif
+	}
+
+	if (user)
+		io_exit(pchar);
+
+	if (ret == VM_FAULT_NOPAGE)
+		atomic64_inc(&bar->faults[level]);
+	return ret;
+}
+
+static vm_fault_t bar_vm_fault(struct vm_fault *vmf)
+{
+	return bar_vm_huge_fault(vmf, 0);
+}
+
+static const struct vm_operations_struct bar_vm_ops = {
+	.fault = bar_vm_fault,
+#ifdef PCHAR_HUGE_PFNMAP
+	.huge_fault = bar_vm_huge_fault,
+#endif
+};
+
+/*
+ * Map the page holding a doorbell, write-combined if so configured,
+ * so that user space can ring it without a system call. The page is
+ * mapped upfront since it is a single one.
+ */
+static int db_mmap(struct pchar_file *pf, struct vm_area_struct *vma,
+		   unsigned long q)
+{
+	struct pci_char *pchar = pf->pchar;
+	struct bar_t *bar;
+	loff_t page;
+	u64 db;
+
+	if (q >= PCHAR_MAX_DOORBELLS)
+		return -EINVAL;
+
+	db = READ_ONCE(pchar->doorbell[q]);
+	if (!(db & DB_VALID) ||
+	    (pf->num != FUNC_MINOR && DB_BAR(db) != pf->num))
+		return -ENXIO;
+
+	bar = &pchar->bar[DB_BAR(db)];
+	page = DB_OFFSET(db) & PAGE_MASK;
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE || bar->phys & ~PAGE_MASK)
+		return -EINVAL;
+
+	if (!policy_map_ok(bar, page, PAGE_SIZE, false))
+		return -EPERM;
+
+	if (!policy_map_ok(bar, page, PAGE_SIZE, true)) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		pchar_vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
+	pchar_vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND |
+				 VM_DONTDUMP);
+	vma->vm_page_prot = db & DB_WC ?
+			    pgprot_writecombine(vma->vm_page_prot) :
+			    pgprot_noncached(vma->vm_page_prot);
+
+	return io_remap_pfn_range(vma, vma->vm_start,
+				  (bar->phys + page) >> PAGE_SHIFT,
+				  PAGE_SIZE, vma->vm_page_prot);
+}
+
+#ifdef PCHAR_HUGE_PFNMAP
+/*
+ * Place BAR mappings so that the virtual address is congruent to the
+ * physical one modulo the largest block that fits, otherwise no huge
+ * entry could ever be installed. Hints and fixed mappings are honoured.
+ */
+static unsigned long dev_get_unmapped_area(struct file *file,
+					   unsigned long addr,
+					   unsigned long len,
+					   unsigned long pgoff,
+					   unsigned long flags)
+{
+	struct pchar_file *pf = file->private_data;
+	loff_t off = (loff_t)pgoff << PAGE_SHIFT;
+	unsigned long align, ret;
+	struct bar_t *bar;
+
+	if (off >= PCHAR_DB_MMAP_BASE)
+		return thp_get_unmapped_area(file, addr, len, pgoff, flags);
+
+	bar = pf_bar(pf, &off);
+	if (!bar || addr || flags & MAP_FIXED || off >= bar->len)
+		return thp_get_unmapped_area(file, addr, len, pgoff, flags);
+
+	align = len >= PUD_SIZE ? PUD_SIZE : PMD_SIZE;
+	if (len < PMD_SIZE || len + align < len)
+		return thp_get_unmapped_area(file, addr, len, pgoff, flags);
+
+	ret = thp_get_unmapped_area(file, 0, len + align, pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return thp_get_unmapped_area(file, addr, len, pgoff, flags);
+
+	return ret + ((bar->phys + off - ret) & (align - 1));
+}
+#endif
+
+static int dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pchar_file *pf = file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	loff_t off = (loff_t)vma->vm_pgoff << PAGE_SHIFT;
+	struct bar_policy *p;
+	struct bar_t *bar;
+	bool ro;
+	int err;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if (off >= PCHAR_PLAYBACK_MMAP_RING)
+		return stream_mmap(&pf->playback, vma, true);
+	if (off >= PCHAR_CAPTURE_MMAP_RING)
+		return stream_mmap(&pf->capture, vma, true);
+	if (off >= PCHAR_PLAYBACK_MMAP_STATUS)
+		return stream_mmap(&pf->playback, vma, false);
+	if (off >= PCHAR_CAPTURE_MMAP_STATUS)
+		return stream_mmap(&pf->capture, vma, false);
+	if (off >= PCHAR_DB_MMAP_BASE) {
+		/* mapped right away, BARs only fault in under the gate */
+		err = io_enter(pf->pchar);
+		if (err)
+			return err;
+		err = db_mmap(pf, vma, (off - PCHAR_DB_MMAP_BASE) /
+			      PCHAR_DB_MMAP_STRIDE);
+		io_exit(pf->pchar);
+		return err;
+	}
+	if (off == PCHAR_STATUS_MMAP)
+		return status_mmap(pf->pchar, vma);
+
+	bar = pf_bar(pf, &off);
+	if (!bar)
+		return -EINVAL;
+
+	/* BARs smaller than a page could share it with another device */
+	if (bar->phys & ~PAGE_MASK || bar->len < PAGE_SIZE)
+		return -EINVAL;
+
+	if (off >= PAGE_ALIGN(bar->len) || size > PAGE_ALIGN(bar->len) - off)
+		return -EINVAL;
+
+	rcu_read_lock();
+	p = rcu_dereference(bar->policy);
+	ro = p && p->ro;
+	if (bar->pbar) {
+		p = rcu_dereference(bar->pbar->policy);
+		ro |= p && p->ro;
+	}
+	rcu_read_unlock();
+
+	if (ro) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		pchar_vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
+	pchar_vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND |
+				 VM_DONTDUMP);
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	vma->vm_private_data = bar;
+	vma->vm_ops = &bar_vm_ops;
+
+	return 0;
+}
+
+static long db_set(struct pchar_file *pf, struct pchar_db_cfg __user *ucfg)
+{
+	struct pchar_db_cfg cfg;
+	unsigned int width;
+	struct bar_t *bar;
+	loff_t off;
+	u64 db = 0;
+	int err;
+
+	if (!pf->writable)
+		return -EBADF;
+
+	if (copy_from_user(&cfg, ucfg, sizeof(cfg)))
+		return -EFAULT;
+
+	if (cfg.queue >= PCHAR_MAX_DOORBELLS ||
+	    cfg.flags & ~(PCHAR_DB_ENABLE | PCHAR_DB_64BIT | PCHAR_DB_WC))
+		return -EINVAL;
+
+	if (cfg.flags & PCHAR_DB_ENABLE) {
+		width = cfg.flags & PCHAR_DB_64BIT ? 8 : 4;
+		off = cfg.offset;
+		bar = pf_bar(pf, &off);
+		if (!bar || off % width || bar_check_bounds(bar, off, width))
+			return -EINVAL;
+
+		err = policy_check(bar, off, width, true);
+		if (err)
+			return err;
+
+		/* PAT would quietly turn WC on an uncached BAR into UC- */
+		if (cfg.flags & PCHAR_DB_WC && !bar->wc)
+			return -EINVAL;
+
+		db = DB_VALID | off |
+		     (u64)bar_num(pf->pchar, bar) << DB_BAR_SHIFT;
+		if (cfg.flags & PCHAR_DB_64BIT)
+			db |= DB_64BIT;
+		if (cfg.flags & PCHAR_DB_WC)
+			db |= DB_WC;
+	}
+
+	WRITE_ONCE(pf->pchar->doorbell[cfg.queue], db);
+
+	return 0;
+}
+
+/*
+ * Ring a batch of doorbells. Only the last value per queue matters
+ * to the device, so the batch is collapsed first and every queue is
+ * written once, in ascending queue order. All queues are checked
+ * against their configuration and the access policy before the first
+ * write, a batch that fails rings nothing.
+ */
+static long db_ring(struct pchar_file *pf, struct pchar_db_ring __user *ur)
+{
+	struct pci_char *pchar = pf->pchar;
+	DECLARE_BITMAP(pending, PCHAR_MAX_DOORBELLS);
+	u64 value[PCHAR_MAX_DOORBELLS];
+	u64 dbs[PCHAR_MAX_DOORBELLS];
+	struct pchar_db ring[DB_CHUNK];
+	const struct pchar_db __user *uring;
+	struct pchar_db_ring r;
+	unsigned int i, n, q;
+	void __iomem *addr;
+	u64 db;
+	int err;
+
+	if (!pf->writable)
+		return -EBADF;
+
+	if (copy_from_user(&r, ur, sizeof(r)))
+		return -EFAULT;
+
+	bitmap_zero(pending, PCHAR_MAX_DOORBELLS);
+	uring = u64_to_user_ptr(r.ring);
+	for (; r.nr; r.nr -= n, uring += n) {
+		n = min_t(u32, r.nr, DB_CHUNK);
+		if (copy_from_user(ring, uring, n * sizeof(ring[0])))
+			return -EFAULT;
+
+		for (i = 0; i < n; i++) {
+			if (ring[i].queue >= PCHAR_MAX_DOORBELLS)
+				return -EINVAL;
+			value[ring[i].queue] = ring[i].value;
+			__set_bit(ring[i].queue, pending);
+		}
+	}
+
+	/* the policy may have changed since PCHAR_IOC_DB_SET */
+	for_each_set_bit(q, pending, PCHAR_MAX_DOORBELLS) {
+		db = READ_ONCE(pchar->doorbell[q]);
+		if (!(db & DB_VALID) ||
+		    (pf->num != FUNC_MINOR && DB_BAR(db) != pf->num))
+			return -ENXIO;
+
+		err = policy_check(&pchar->bar[DB_BAR(db)], DB_OFFSET(db),
+				   db & DB_64BIT ? 8 : 4, true);
+		if (err)
+			return err;
+		dbs[q] = db;
+	}
+
+	for_each_set_bit(q, pending, PCHAR_MAX_DOORBELLS) {
+		db = dbs[q];
+		addr = pchar->bar[DB_BAR(db)].addr + DB_OFFSET(db);
+		if (db & DB_64BIT)
+			writeq(value[q], addr);
+		else
+			writel(value[q], addr);
+		bar_stat(&pchar->bar[DB_BAR(db)], true, 1,
+			 db & DB_64BIT ? 8 : 4);
+		mark_dirty(pf, DB_BAR(db));
+	}
+
+	return 0;
+}
+
+static irqreturn_t pchar_irq_handler(int irq, void *data)
+{
+	struct pchar_irq *pi = data;
+
+	atomic64_inc(&pi->count);
+	this_cpu_inc(pi->pchar->stats->ev[EV_IRQS]);
+	wake_up_all(&pi->wq);
+
+	spin_lock(&pi->lock);
+	if (pi->efd)
+		pchar_eventfd_signal(pi->efd);
+	spin_unlock(&pi->lock);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Interrupts are optional. A device without MSI-X/MSI keeps working,
+ * its waiters just poll the status register while sleeping.
+ */
+static int irq_setup(struct pci_char *pchar)
+{
+	struct pci_dev *pdev = pchar->pdev;
+	int nvec, i, err;
+
+	if (!irq_vectors)
+		return 0;
+
+	nvec = pci_alloc_irq_vectors(pdev, 1, irq_vectors,
+				     PCI_IRQ_MSIX | PCI_IRQ_MSI);
+	if (nvec < 0) {
+		dev_warn(&pdev->dev, "no MSI-X/MSI, waits will poll (%d)\n",
+			 nvec);
+		return 0;
+	}
+
+	pchar->irq = kcalloc(nvec, sizeof(*pchar->irq), GFP_KERNEL);
+	if (!pchar->irq) {
+		err = -ENOMEM;
+		goto failure_alloc;
+	}
+
+	for (i = 0; i < nvec; i++) {
+		struct pchar_irq *pi = &pchar->irq[i];
+
+		pi->pchar = pchar;
+		init_waitqueue_head(&pi->wq);
+		spin_lock_init(&pi->lock);
+		err = request_irq(pci_irq_vector(pdev, i), pchar_irq_handler,
+				  0, "pci-char", pi);
+		if (err)
+			break;
+	}
+
+	if (err) {
+		for (i--; i >= 0; i--)
+			free_irq(pci_irq_vector(pdev, i), &pchar->irq[i]);
+		kfree(pchar->irq);
+		pchar->irq = NULL;
+		goto failure_alloc;
+	}
+
+	/* MSIs are memory writes of the device */
+	pci_set_master(pdev);
+	pchar->nr_irqs = nvec;
+
+	return 0;
+
+failure_alloc:
+	pci_free_irq_vectors(pdev);
+	return err;
+}
+
+static void irq_teardown(struct pci_char *pchar)
+{
+	struct pci_dev *pdev = pchar->pdev;
+	unsigned int i;
+
+	if (!pchar->irq)
+		return;
+
+	for (i = 0; i < pchar->nr_irqs; i++) {
+		free_irq(pci_irq_vector(pdev, i), &pchar->irq[i]);
+		if (pchar->irq[i].efd)
+			eventfd_ctx_put(pchar->irq[i].efd);
+	}
+
+	/* the array goes with the device, sleepers may still look at it */
+	pci_free_irq_vectors(pdev);
+}
+
+static long irq_set_eventfd(struct pchar_file *pf,
+			    struct pchar_irq_eventfd __user *ue)
+{
+	struct pci_char *pchar = pf->pchar;
+	struct eventfd_ctx *efd = NULL, *old;
+	struct pchar_irq_eventfd e;
+	struct pchar_irq *pi;
+
+	if (copy_from_user(&e, ue, sizeof(e)))
+		return -EFAULT;
+
+	if (e.vector >= pchar->nr_irqs)
+		return -EINVAL;
+
+	if (e.fd >= 0) {
+		efd = eventfd_ctx_fdget(e.fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	pi = &pchar->irq[e.vector];
+	spin_lock_irq(&pi->lock);
+	old = pi->efd;
+	pi->efd = efd;
+	spin_unlock_irq(&pi->lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/*
+ * Wait for a status register to match. Busy polling for spin_ns
+ * catches completions that arrive within a few microseconds at the
+ * lowest latency, afterwards the caller sleeps until the interrupt
+ * vector fires or, without one, polls with growing delays. A sleeping
+ * caller also wakes up to step aside for error recovery.
+ */
+static long dev_wait(struct pchar_file *pf, struct pchar_wait __user *uw)
+{
+	struct pci_char *pchar = pf->pchar;
+	struct bar_t *bar;
+	unsigned long delay = WAIT_POLL_MIN;
+	struct pchar_irq *pi = NULL;
+	u64 start, now, deadline;
+	struct pchar_wait w;
+	s64 seq = 0;
+	loff_t off;
+	int err;
+
+	if (copy_from_user(&w, uw, sizeof(w)))
+		return -EFAULT;
+
+	off = w.offset;
+	bar = pf_bar(pf, &off);
+	if (!bar || off % 4 || bar_check_bounds(bar, off, 4))
+		return -EINVAL;
+
+	err = policy_check(bar, off, 4, false);
+	if (err)
+		return err;
+
+	if (w.vector != PCHAR_WAIT_NO_IRQ) {
+		if (w.vector >= pchar->nr_irqs)
+			return -EINVAL;
+		pi = &pchar->irq[w.vector];
+	}
+
+	err = io_enter(pchar);
+	if (err)
+		return err;
+
+	stage_sync(pf);
+	w.result = 0;
+	w.spin_ns = min_t(u64, w.spin_ns, READ_ONCE(wait_spin_max_ns));
+	start = ktime_get_ns();
+	deadline = w.timeout_ns ? start + w.timeout_ns : U64_MAX;
+
+	for (;;) {
+		w.last = readl(bar->addr + off);
+		bar_stat(bar, false, 1, 4);
+		if ((w.last & w.mask) == w.value) {
+			w.result = PCHAR_WAITED_SPIN;
+			atomic64_inc(&pchar->wait_spin);
+			goto out;
+		}
+		err = dev_check(pchar, w.last);
+		if (err == -ENODEV)
+			goto out;
+		if (err)	/* in recovery, sleeping sits it out */
+			break;
+
+		now = ktime_get_ns();
+		if (now - start >= w.spin_ns || now >= deadline)
+			break;
+		/* the sleeping phase deals with all of these */
+		if (need_resched() || signal_pending(current) ||
+		    READ_ONCE(pchar->state) != DEV_LIVE)
+			break;
+		cpu_relax();
+	}
+
+	for (;;) {
+		/* sit out error recovery, the deadline keeps running */
+		if (READ_ONCE(pchar->state) != DEV_LIVE) {
+			io_exit(pchar);
+			err = io_enter(pchar);
+			if (err)
+				return err;
+		}
+
+		/* sample the count first, so no interrupt gets lost */
+		if (pi)
+			seq = atomic64_read(&pi->count);
+
+		w.last = readl(bar->addr + off);
+		bar_stat(bar, false, 1, 4);
+		if ((w.last & w.mask) == w.value) {
+			w.result = pi ? PCHAR_WAITED_IRQ : PCHAR_WAITED_POLL;
+			atomic64_inc(&pchar->wait_sleep);
+			goto out;
+		}
+		err = dev_check(pchar, w.last);
+		if (err == -ENODEV)
+			goto out;
+		err = 0;
+
+		now = ktime_get_ns();
+		if (now >= deadline) {
+			atomic64_inc(&pchar->wait_timeout);
+			err = -ETIMEDOUT;
+			goto out;
+		}
+
+		if (pi) {
+			err = wait_event_interruptible_hrtimeout(pi->wq,
+					atomic64_read(&pi->count) != seq ||
+					READ_ONCE(pchar->state) != DEV_LIVE,
+					ns_to_ktime(min_t(u64, deadline - now,
+							  KTIME_MAX)));
+			if (err == -ETIME)
+				err = 0;
+		} else {
+			usleep_range(delay, delay * 2);
+			delay = min_t(unsigned long, delay * 2, WAIT_POLL_MAX);
+			if (signal_pending(current))
+				err = -ERESTARTSYS;
+		}
+		if (err) {
+			io_exit(pchar);
+			return err;
+		}
+	}
+
+out:
+	io_exit(pchar);
+	if (copy_to_user(uw, &w, sizeof(w)))
+		return -EFAULT;
+
+	return err;
+}
+
+/*
+ * Read-modify-write of a register under a lock hashed from its
+ * physical address, so that BAR, func and window nodes aliasing the
+ * same register serialise against each other.
+ */
+static long dev_atomic(struct pchar_file *pf, struct pchar_atomic __user *ua)
+{
+	struct pci_char *pchar = pf->pchar;
+	struct pchar_atomic a;
+	struct bar_t *bar;
+	unsigned int width;
+	spinlock_t *lock;
+	u64 old, new;
+	u32 new32;
+	loff_t off;
+	int err;
+
+	if (!pf->writable)
+		return -EBADF;
+
+	if (copy_from_user(&a, ua, sizeof(a)))
+		return -EFAULT;
+
+	width = a.flags & PCHAR_ATOMIC_64BIT ? 8 : 4;
+	off = a.offset;
+	bar = pf_bar(pf, &off);
+	if (!bar || a.op > PCHAR_ATOMIC_CAS ||
+	    a.flags & ~PCHAR_ATOMIC_64BIT || off % width ||
+	    bar_check_bounds(bar, off, width))
+		return -EINVAL;
+
+	err = policy_check(bar, off, width, true);
+	if (err)
+		return err;
+
+	if (width == 4) {
+		a.value = (u32)a.value;
+		a.compare = (u32)a.compare;
+	}
+
+	lock = &pchar->atomic_lock[hash_64(bar->phys + off, ATOMIC_BITS)];
+	spin_lock(lock);
+	old = width == 8 ? readq(bar->addr + off) : readl(bar->addr + off);
+	bar_stat(bar, false, 1, width);
+
+	switch (a.op) {
+	case PCHAR_ATOMIC_ADD:
+		new = old + a.value;
+		break;
+	case PCHAR_ATOMIC_AND:
+		new = old & a.value;
+		break;
+	case PCHAR_ATOMIC_OR:
+		new = old | a.value;
+		break;
+	case PCHAR_ATOMIC_XOR:
+		new = old ^ a.value;
+		break;
+	case PCHAR_ATOMIC_SWAP:
+		new = a.value;
+		break;
+	default:
+		new = a.value;
+		break;
+	}
+
+	/* a failed compare does not touch the register */
+	if (a.op != PCHAR_ATOMIC_CAS || old == a.compare) {
+		bar_stat(bar, true, 1, width);
+		if (width == 8) {
+			writeq(new, bar->addr + off);
+			cache_update(bar, off, &new, 8);
+		} else {
+			new32 = new;
+			writel(new32, bar->addr + off);
+			cache_update(bar, off, &new32, 4);
+		}
+	}
+	spin_unlock(lock);
+
+	mark_dirty(pf, bar_num(pchar, bar));
+
+	a.old = old;
+	if (copy_to_user(ua, &a, sizeof(a)))
+		return -EFAULT;
+
+	return 0;
+}
+
+#ifdef PCHAR_P2PDMA
+/* BAR and offset of a buffer in a mapping of P2PDMA memory */
+static long p2p_offset(struct pchar_file *pf,
+		       struct pchar_p2p_offset __user *uo)
+{
+	struct pci_char *pchar = pf->pchar;
+	struct pchar_p2p_offset o;
+	struct page *page;
+	phys_addr_t phys;
+	unsigned int i;
+	int ret;
+
+	if (copy_from_user(&o, uo, sizeof(o)))
+		return -EFAULT;
+
+	ret = pin_user_pages_fast(o.addr, 1, FOLL_PCI_P2PDMA, &page);
+	if (ret != 1)
+		return ret < 0 ? ret : -EFAULT;
+
+	phys = page_to_phys(page) + offset_in_page(o.addr);
+	unpin_user_page(page);
+
+	for (i = 0; i < 6; i++) {
+		struct bar_t *bar = &pchar->bar[i];
+
+		if (!bar->len || phys < bar->phys ||
+		    phys - bar->phys >= bar->len)
+			continue;
+
+		o.bar = i;
+		o.offset = phys - bar->phys;
+		return copy_to_user(uo, &o, sizeof(o)) ? -EFAULT : 0;
+	}
+
+	/* P2PDMA memory of another device */
+	return -EINVAL;
+}
+#endif
+
+static long err_set_eventfd(struct pci_char *pchar, s32 __user *ufd)
+{
+	struct eventfd_ctx *efd = NULL, *old;
+	s32 fd;
+
+	if (get_user(fd, ufd))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	spin_lock(&pchar->err_lock);
+	old = pchar->err_efd;
+	pchar->err_efd = efd;
+	spin_unlock(&pchar->err_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/* Switch write staging of a file on or off, off flushes */
+static int set_staging(struct pchar_file *pf, bool on)
+{
+	int err = 0;
+
+	mutex_lock(&pf->lock);
+	if (on && !pf->stage_buf) {
+		pf->stage_buf = kvmalloc(STAGE_SIZE, GFP_KERNEL);
+		if (!pf->stage_buf)
+			err = -ENOMEM;
+	}
+
+	if (!on)
+		stage_flush(pf);
+
+	if (!err)
+		WRITE_ONCE(pf->staging, on);
+	mutex_unlock(&pf->lock);
+
+	return err;
+}
+
+static long dev_ioctl_io(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct pchar_file *pf = file->private_data;
+	void __user *argp = (void __user *)arg;
+	struct pchar_range range;
+	struct bar_t *bar;
+	unsigned int i;
+	loff_t off;
+	u32 val;
+
+	switch (cmd) {
+	case PCHAR_IOC_CACHE_INVAL:
+		if (pf->num != FUNC_MINOR) {
+			bar = &pf->pchar->bar[pf->num];
+			cache_invalidate(bar, 0, bar->len);
+			return 0;
+		}
+		for (i = 0; i < 6; i++) {
+			bar = &pf->pchar->bar[i];
+			if (bar->len)
+				cache_invalidate(bar, 0, bar->len);
+		}
+		return 0;
+
+	case PCHAR_IOC_CACHE_INVAL_RANGE:
+		if (copy_from_user(&range, argp, sizeof(range)))
+			return -EFAULT;
+		off = range.offset;
+		bar = pf_bar(pf, &off);
+		if (!bar || off % 4 || range.len % 4 ||
+		    bar_check_bounds(bar, off, range.len))
+			return -EINVAL;
+		cache_invalidate(bar, off, range.len);
+		return 0;
+
+	case PCHAR_IOC_WRITE_STAGING:
+		if (get_user(val, (u32 __user *)argp))
+			return -EFAULT;
+		return set_staging(pf, val);
+
+	case PCHAR_IOC_BATCH:
+		return dev_batch(pf, argp);
+
+	case PCHAR_IOC_JOB_SUBMIT:
+		return job_submit(pf, argp);
+
+	case PCHAR_IOC_JOB_STATUS:
+		return job_status(pf, argp);
+
+	case PCHAR_IOC_LOAD:
+		return load_submit(pf, argp);
+
+	case PCHAR_IOC_DB_SET:
+		return db_set(pf, argp);
+
+	case PCHAR_IOC_DB_RING:
+		return db_ring(pf, argp);
+
+	case PCHAR_IOC_IRQ_EVENTFD:
+		return irq_set_eventfd(pf, argp);
+
+	case PCHAR_IOC_ATOMIC:
+		return dev_atomic(pf, argp);
+
+	case PCHAR_IOC_CAPTURE_START:
+		return capture_start(pf, argp);
+
+	case PCHAR_IOC_CAPTURE_STOP:
+		return stream_stop(pf, &pf->capture);
+
+	case PCHAR_IOC_CAPTURE_ADVANCE:
+		return stream_advance(&pf->capture, argp);
+
+	case PCHAR_IOC_PLAYBACK_START:
+		return playback_start(pf, argp);
+
+	case PCHAR_IOC_PLAYBACK_STOP:
+		return stream_stop(pf, &pf->playback);
+
+	case PCHAR_IOC_PLAYBACK_SUBMIT:
+		return stream_advance(&pf->playback, argp);
+
+#ifdef PCHAR_P2PDMA
+	case PCHAR_IOC_P2P_OFFSET:
+		return p2p_offset(pf, argp);
+#endif
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct pchar_file *pf = file->private_data;
+	void __user *argp = (void __user *)arg;
+	long ret;
+
+	/* these may sleep for long, they must not hold off error recovery */
+	switch (cmd) {
+	case PCHAR_IOC_JOB_WAIT:
+		return job_wait(pf, argp);
+
+	case PCHAR_IOC_WAIT:
+		return dev_wait(pf, argp);
+
+	case PCHAR_IOC_ERR_EVENTFD:
+		return err_set_eventfd(pf->pchar, argp);
+	}
+
+	ret = io_enter(pf->pchar);
+	if (ret)
+		return ret;
+
+	stage_sync(pf);
+	ret = dev_ioctl_io(file, cmd, arg);
+	io_exit(pf->pchar);
+	return ret;
+}
+
+static const struct file_operations fops = {
+	.owner	 = THIS_MODULE,
+	.llseek  = dev_seek,
+	.open	 = dev_open,
+	.flush	 = dev_flush,
+	.fsync	 = dev_fsync,
+	.release = dev_release,
+	.read	 = dev_read,
+	.write	 = dev_write,
+	.mmap	 = dev_mmap,
+#ifdef PCHAR_HUGE_PFNMAP
+	.get_unmapped_area = dev_get_unmapped_area,
+#endif
+	.poll	 = dev_poll,
+	.unlocked_ioctl = dev_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+};
+
+/*
+ * Policies are edited on a private copy which is then published,
+ * an empty policy is dropped altogether to restore the fast path.
+ */
+static struct bar_policy *policy_begin(struct pci_char *pchar, unsigned int num)
+{
+	struct bar_policy *old, *new;
+
+	mutex_lock(&pchar->cfg_lock);
+	old = rcu_dereference_protected(pchar->bar[num].policy,
+					lockdep_is_held(&pchar->cfg_lock));
+	if (old)
+		new = kmemdup(old, sizeof(*old), GFP_KERNEL);
+	else
+		new = kzalloc(sizeof(*new), GFP_KERNEL);
+
+	if (!new)
+		mutex_unlock(&pchar->cfg_lock);
+
+	return new;
+}
+
+static void policy_commit(struct pci_char *pchar, unsigned int num,
+			  struct bar_policy *new)
+{
+	struct bar_t *bar = &pchar->bar[num], *win;
+	struct bar_policy *old;
+	unsigned int i;
+
+	if (new && !new->ro && !new->nr_ranges && !new->nr_once) {
+		kfree(new);
+		new = NULL;
+	}
+
+	old = rcu_dereference_protected(bar->policy,
+					lockdep_is_held(&pchar->cfg_lock));
+	rcu_assign_pointer(bar->policy, new);
+	mutex_unlock(&pchar->cfg_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	/* existing user mappings have to fault in again under the new rules */
+	if (bar->mapping)
+		unmap_mapping_range(bar->mapping, 0, 0, 1);
+	if (num < 6 && pchar->func_mapping)
+		unmap_mapping_range(pchar->func_mapping,
+				    (loff_t)num << PCHAR_FUNC_BAR_SHIFT,
+				    BIT_ULL(PCHAR_FUNC_BAR_SHIFT), 1);
+
+	/* sub-windows are bound by the policy of their BAR as well */
+	for (i = 6; num < 6 && i < FUNC_MINOR; i++) {
+		win = &pchar->bar[i];
+		if (win->len && win->parent == num && win->mapping)
+			unmap_mapping_range(win->mapping, 0, 0, 1);
+	}
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+	const struct bar_range *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static int cmp_loff(const void *a, const void *b)
+{
+	const loff_t *la = a, *lb = b;
+
+	return *la < *lb ? -1 : *la > *lb;
+}
+
+static ssize_t readonly_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_policy *p;
+	bool ro;
+
+	rcu_read_lock();
+	p = rcu_dereference(pchar->bar[MINOR(dev->devt)].policy);
+	ro = p && p->ro;
+	rcu_read_unlock();
+
+	return sprintf(buf, "%d\n", ro);
+}
+
+static ssize_t readonly_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	unsigned int num = MINOR(dev->devt);
+	struct bar_policy *p;
+	bool ro;
+
+	if (kstrtobool(buf, &ro))
+		return -EINVAL;
+
+	p = policy_begin(pchar, num);
+	if (!p)
+		return -ENOMEM;
+
+	p->ro = ro;
+	policy_commit(pchar, num, p);
+
+	return count;
+}
+static DEVICE_ATTR_RW(readonly);
+
+/*
+ * Parse a comma separated list of "start-end" windows, end inclusive,
+ * into sorted disjoint ranges. Returns the number of ranges.
+ */
+static int parse_ranges(const char *buf, size_t count, resource_size_t len,
+			struct bar_range *range)
+{
+	unsigned long long start, end;
+	char *str, *pos, *tok;
+	int i, nr = 0;
+	int err = 0;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	pos = strim(str);
+	while ((tok = strsep(&pos, ","))) {
+		if (!strlen(tok))
+			continue;
+
+		if (nr == MAX_RANGES) {
+			err = -E2BIG;
+			break;
+		}
+
+		if (sscanf(tok, "%llx-%llx", &start, &end) != 2 ||
+		    start > end || end >= len ||
+		    start % 4 || (end + 1) % 4) {
+			err = -EINVAL;
+			break;
+		}
+
+		range[nr].start = start;
+		range[nr].end = end + 1;
+		nr++;
+	}
+	kfree(str);
+
+	if (err)
+		return err;
+
+	sort(range, nr, sizeof(range[0]), cmp_range, NULL);
+	for (i = 1; i < nr; i++)
+		if (range[i].start < range[i - 1].end)
+			return -EINVAL;
+
+	return nr;
+}
+
+static ssize_t show_ranges(char *buf, const struct bar_range *range,
+			   unsigned int nr)
+{
+	ssize_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s0x%llx-0x%llx",
+				 i ? "," : "", range[i].start,
+				 range[i].end - 1);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+/* Allowed windows as comma separated list of "start-end", end inclusive */
+static ssize_t ranges_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_policy *p;
+	ssize_t len;
+
+	rcu_read_lock();
+	p = rcu_dereference(pchar->bar[MINOR(dev->devt)].policy);
+	len = p ? show_ranges(buf, p->range, p->nr_ranges) :
+		  show_ranges(buf, NULL, 0);
+	rcu_read_unlock();
+
+	return len;
+}
+
+static ssize_t ranges_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	unsigned int num = MINOR(dev->devt);
+	struct bar_range range[MAX_RANGES];
+	struct bar_policy *p;
+	int nr;
+
+	nr = parse_ranges(buf, count, pchar->bar[num].len, range);
+	if (nr < 0)
+		return nr;
+
+	p = policy_begin(pchar, num);
+	if (!p)
+		return -ENOMEM;
+
+	memcpy(p->range, range, sizeof(range));
+	p->nr_ranges = nr;
+	policy_commit(pchar, num, p);
+
+	return count;
+}
+static DEVICE_ATTR_RW(ranges);
+
+/* Write-once registers as comma separated list, rewriting re-arms them */
+static ssize_t write_once_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_policy *p;
+	ssize_t len = 0;
+	unsigned int i;
+
+	rcu_read_lock();
+	p = rcu_dereference(pchar->bar[MINOR(dev->devt)].policy);
+	for (i = 0; p && i < p->nr_once; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s0x%llx%s",
+				 i ? "," : "", p->once[i],
+				 test_bit(i, p->once_done) ? "*" : "");
+	rcu_read_unlock();
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+static ssize_t write_once_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	unsigned int num = MINOR(dev->devt);
+	loff_t once[MAX_ONCE];
+	unsigned long long off;
+	unsigned int i, nr = 0;
+	struct bar_policy *p;
+	char *str, *pos, *tok;
+	int err = 0;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	pos = strim(str);
+	while ((tok = strsep(&pos, ","))) {
+		if (!strlen(tok))
+			continue;
+
+		if (nr == MAX_ONCE) {
+			err = -E2BIG;
+			break;
+		}
+
+		if (kstrtoull(tok, 16, &off) || off % 4 ||
+		    off + 4 > pchar->bar[num].len) {
+			err = -EINVAL;
+			break;
+		}
+
+		once[nr++] = off;
+	}
+	kfree(str);
+
+	if (err)
+		return err;
+
+	sort(once, nr, sizeof(once[0]), cmp_loff, NULL);
+	for (i = 1; i < nr; i++)
+		if (once[i] == once[i - 1])
+			return -EINVAL;
+
+	p = policy_begin(pchar, num);
+	if (!p)
+		return -ENOMEM;
+
+	memcpy(p->once, once, sizeof(once));
+	p->nr_once = nr;
+	bitmap_zero(p->once_done, MAX_ONCE);
+	policy_commit(pchar, num, p);
+
+	return count;
+}
+static DEVICE_ATTR_RW(write_once);
+
+/* Cacheable windows, same format as ranges. Rewriting drops the shadow */
+static ssize_t cached_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_cache *c;
+	ssize_t len;
+
+	rcu_read_lock();
+	c = rcu_dereference(pchar->bar[MINOR(dev->devt)].cache);
+	len = c ? show_ranges(buf, c->range, c->nr_ranges) :
+		  show_ranges(buf, NULL, 0);
+	rcu_read_unlock();
+
+	return len;
+}
+
+static ssize_t cached_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_t *bar = &pchar->bar[MINOR(dev->devt)];
+	struct bar_cache *old, *new = NULL;
+	loff_t total = 0;
+	size_t regs;
+	int i, nr;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	nr = parse_ranges(buf, count, bar->len, new->range);
+	if (nr < 0) {
+		kfree(new);
+		return nr;
+	}
+
+	/* a sub-window goes through the shadow of its BAR */
+	if (bar->pbar) {
+		kfree(new);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nr; i++)
+		total += new->range[i].end - new->range[i].start;
+	if (total > MAX_CACHED) {
+		kfree(new);
+		return -E2BIG;
+	}
+
+	spin_lock_init(&new->lock);
+	for (i = 0; i < nr; i++) {
+		regs = (new->range[i].end - new->range[i].start) / 4;
+		new->data[i] = kvcalloc(regs, sizeof(u32), GFP_KERNEL);
+		new->valid[i] = kvcalloc(BITS_TO_LONGS(regs),
+					 sizeof(unsigned long), GFP_KERNEL);
+		new->nr_ranges = i + 1;
+		if (!new->data[i] || !new->valid[i]) {
+			cache_free(new);
+			return -ENOMEM;
+		}
+	}
+
+	if (!nr) {
+		kfree(new);
+		new = NULL;
+	}
+
+	mutex_lock(&pchar->cfg_lock);
+	old = rcu_dereference_protected(bar->cache,
+					lockdep_is_held(&pchar->cfg_lock));
+	rcu_assign_pointer(bar->cache, new);
+	mutex_unlock(&pchar->cfg_lock);
+
+	if (old)
+		call_rcu(&old->rcu, cache_free_rcu);
+
+	return count;
+}
+static DEVICE_ATTR_RW(cached);
+
+/* Register read back by fsync() and close() to flush posted writes */
+static ssize_t flush_offset_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "0x%llx\n",
+		       READ_ONCE(pchar->bar[MINOR(dev->devt)].flush_off));
+}
+
+static ssize_t flush_offset_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_t *bar = &pchar->bar[MINOR(dev->devt)];
+	unsigned long long off;
+
+	if (kstrtoull(buf, 16, &off) || off % 4 || off + 4 > bar->len)
+		return -EINVAL;
+
+	WRITE_ONCE(bar->flush_off, off);
+
+	return count;
+}
+static DEVICE_ATTR_RW(flush_offset);
+
+/* Entries installed by mmap faults, per page size */
+static ssize_t map_faults_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_t *bar = &pchar->bar[MINOR(dev->devt)];
+
+	return sprintf(buf, "pte %lld\npmd %lld\npud %lld\n",
+		       atomic64_read(&bar->faults[0]),
+		       atomic64_read(&bar->faults[1]),
+		       atomic64_read(&bar->faults[2]));
+}
+static DEVICE_ATTR_RO(map_faults);
+
+/* Bytes moved through read() and write() */
+static ssize_t rw_bytes_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_t *bar = &pchar->bar[MINOR(dev->devt)];
+
+	return sprintf(buf, "read %lld\nwritten %lld\n",
+		       atomic64_read(&bar->rd_bytes),
+		       atomic64_read(&bar->wr_bytes));
+}
+static DEVICE_ATTR_RO(rw_bytes);
+
+static struct attribute *bar_attrs[] = {
+	&dev_attr_readonly.attr,
+	&dev_attr_ranges.attr,
+	&dev_attr_write_once.attr,
+	&dev_attr_cached.attr,
+	&dev_attr_flush_offset.attr,
+	&dev_attr_map_faults.attr,
+	&dev_attr_rw_bytes.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(bar);
+
+/*
+ * Sub-windows are bar_t entries behind the six BARs that alias a page
+ * aligned part of one, with their own node, bounds, policy and
+ * statistics. They share the shadow cache of the BAR they lie in.
+ * Returns the window number.
+ */
+static int window_add(struct pci_char *pchar, unsigned int parent,
+		      u64 start, u64 len, bool ro)
+{
+	struct pci_dev *pdev = pchar->pdev;
+	struct bar_policy *p = NULL;
+	struct bar_t *pbar, *bar;
+	unsigned int i, num = 0;
+	struct device *dev;
+	int err = 0;
+
+	if (parent > 5 || !len || start % PAGE_SIZE || len % PAGE_SIZE)
+		return -EINVAL;
+
+	pbar = &pchar->bar[parent];
+	if (!pbar->len || start >= pbar->len || len > pbar->len - start)
+		return -EINVAL;
+
+	if (ro) {
+		p = kzalloc(sizeof(*p), GFP_KERNEL);
+		if (!p)
+			return -ENOMEM;
+		p->ro = true;
+	}
+
+	mutex_lock(&pchar->win_lock);
+
+	/* windows of a BAR must not overlap, else they are not isolated */
+	for (i = 6; i < FUNC_MINOR; i++) {
+		bar = &pchar->bar[i];
+		if (!bar->len) {
+			if (!num)
+				num = i;
+		} else if (bar->parent == parent &&
+			   start < bar->start + bar->len &&
+			   bar->start < start + len) {
+			err = -EBUSY;
+			goto out;
+		}
+	}
+
+	err = -ENOSPC;
+	if (!num)
+		goto out;
+
+	bar = &pchar->bar[num];
+	bar->parent = parent;
+	bar->pbar = pbar;
+	bar->start = start;
+	bar->phys = pbar->phys + start;
+	bar->addr = pbar->addr + start;
+	bar->wc = pbar->wc;
+	bar->stats = pbar->stats;
+	bar->mapping = NULL;
+	bar->flush_off = 0;
+	for (i = 0; i < ARRAY_SIZE(bar->faults); i++)
+		atomic64_set(&bar->faults[i], 0);
+	atomic64_set(&bar->rd_bytes, 0);
+	atomic64_set(&bar->wr_bytes, 0);
+	RCU_INIT_POINTER(bar->policy, p);
+
+	dev = device_create_with_groups(pchar_class, &pdev->dev,
+					MKDEV(pchar->major, num),
+					pchar, bar_groups,
+					"b%xd%xf%x_win%d",
+					pdev->bus->number,
+					PCI_SLOT(pdev->devfn),
+					PCI_FUNC(pdev->devfn),
+					num - 6);
+	if (IS_ERR(dev)) {
+		err = PTR_ERR(dev);
+		RCU_INIT_POINTER(bar->policy, NULL);
+		goto out;
+	}
+	p = NULL;
+
+	/* publish, opens check the length */
+	mutex_lock(&pchar->cfg_lock);
+	bar->len = len;
+	mutex_unlock(&pchar->cfg_lock);
+	err = num - 6;
+out:
+	mutex_unlock(&pchar->win_lock);
+	kfree(p);
+	return err;
+}
+
+static int window_del(struct pci_char *pchar, unsigned int win)
+{
+	unsigned int num = win + 6, q;
+	struct bar_t *bar;
+	int err = 0;
+	u64 db;
+
+	if (win >= MAX_WINDOWS)
+		return -EINVAL;
+
+	bar = &pchar->bar[num];
+	mutex_lock(&pchar->win_lock);
+
+	mutex_lock(&pchar->cfg_lock);
+	if (!bar->len)
+		err = -ENOENT;
+	else if (bar->users)
+		err = -EBUSY;
+	else
+		bar->len = 0;
+	mutex_unlock(&pchar->cfg_lock);
+
+	if (!err) {
+		/* doorbells of the window must not outlive it */
+		for (q = 0; q < PCHAR_MAX_DOORBELLS; q++) {
+			db = READ_ONCE(pchar->doorbell[q]);
+			if (!(db & DB_VALID) || DB_BAR(db) != num)
+				continue;
+			WRITE_ONCE(pchar->doorbell[q], 0);
+			if (pchar->func_mapping)
+				unmap_mapping_range(pchar->func_mapping,
+						    PCHAR_DB_MMAP_OFFSET(q),
+						    PCHAR_DB_MMAP_STRIDE, 1);
+		}
+		if (bar->mapping)
+			unmap_mapping_range(bar->mapping, 0, 0, 1);
+
+		/* no file left, and no attribute once the device is gone */
+		device_destroy(pchar_class, MKDEV(pchar->major, num));
+		kfree(rcu_access_pointer(bar->policy));
+		RCU_INIT_POINTER(bar->policy, NULL);
+	}
+
+	mutex_unlock(&pchar->win_lock);
+	return err;
+}
+
+/* Attributes of the PCI device, below its pci_char directory */
+static ssize_t irq_vectors_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", pchar->nr_irqs);
+}
+static DEVICE_ATTR_RO(irq_vectors);
+
+/* How hybrid waits completed, for tuning the spin budget */
+static ssize_t wait_spin_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", atomic64_read(&pchar->wait_spin));
+}
+static DEVICE_ATTR_RO(wait_spin);
+
+static ssize_t wait_sleep_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", atomic64_read(&pchar->wait_sleep));
+}
+static DEVICE_ATTR_RO(wait_sleep);
+
+static ssize_t wait_timeout_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", atomic64_read(&pchar->wait_timeout));
+}
+static DEVICE_ATTR_RO(wait_timeout);
+
+static ssize_t errors_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", atomic64_read(&pchar->errors));
+}
+static DEVICE_ATTR_RO(errors);
+
+static ssize_t recoveries_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lld\n", atomic64_read(&pchar->recoveries));
+}
+static DEVICE_ATTR_RO(recoveries);
+
+/* Duration of the last error recovery or reset */
+static ssize_t recovery_us_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n",
+		       READ_ONCE(pchar->recovery_ns) / NSEC_PER_USEC);
+}
+static DEVICE_ATTR_RO(recovery_us);
+
+/* AtomicOp completer sizes the device may use towards host memory */
+static ssize_t atomic_ops_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	u32 caps = pchar->atomic_caps;
+	ssize_t len = 0;
+
+	if (!caps)
+		return sprintf(buf, "none\n");
+
+	if (caps & PCI_EXP_DEVCAP2_ATOMIC_COMP32)
+		len += sprintf(buf + len, "32 ");
+	if (caps & PCI_EXP_DEVCAP2_ATOMIC_COMP64)
+		len += sprintf(buf + len, "64 ");
+	if (caps & PCI_EXP_DEVCAP2_ATOMIC_COMP128)
+		len += sprintf(buf + len, "128 ");
+	buf[len - 1] = '\n';
+
+	return len;
+}
+static DEVICE_ATTR_RO(atomic_ops);
+
+/* Sub-windows, one "winN barM start-end ro|rw" line each */
+static ssize_t windows_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	struct bar_policy *p;
+	struct bar_t *bar;
+	ssize_t len = 0;
+	unsigned int i;
+	bool ro;
+
+	mutex_lock(&pchar->win_lock);
+	for (i = 6; i < FUNC_MINOR; i++) {
+		bar = &pchar->bar[i];
+		if (!bar->len)
+			continue;
+
+		rcu_read_lock();
+		p = rcu_dereference(bar->policy);
+		ro = p && p->ro;
+		rcu_read_unlock();
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "win%u bar%u 0x%llx-0x%llx %s\n", i - 6,
+				 bar->parent, (unsigned long long)bar->start,
+				 (unsigned long long)(bar->start + bar->len - 1),
+				 ro ? "ro" : "rw");
+	}
+	mutex_unlock(&pchar->win_lock);
+
+	return len;
+}
+static DEVICE_ATTR_RO(windows);
+
+/* "bar start length [ro]", the window number is logged */
+static ssize_t new_window_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	unsigned long long start, len;
+	unsigned int parent;
+	char mode[3] = "rw";
+	int n, win;
+
+	n = sscanf(buf, "%u %llx %llx %2s", &parent, &start, &len, mode);
+	if (n < 3 || (strcmp(mode, "ro") && strcmp(mode, "rw")))
+		return -EINVAL;
+
+	win = window_add(pchar, parent, start, len, !strcmp(mode, "ro"));
+	if (win < 0)
+		return win;
+
+	dev_info(dev, "win%d: bar%u 0x%llx-0x%llx %s\n", win, parent,
+		 start, start + len - 1, mode);
+	return count;
+}
+static DEVICE_ATTR_WO(new_window);
+
+static ssize_t remove_window_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct pci_char *pchar = dev_get_drvdata(dev);
+	unsigned int win;
+	int err;
+
+	if (kstrtouint(buf, 0, &win))
+		return -EINVAL;
+
+	err = window_del(pchar, win);
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_WO(remove_window);
+
+static struct attribute *pchar_dev_attrs[] = {
+	&dev_attr_irq_vectors.attr,
+	&dev_attr_atomic_ops.attr,
+	&dev_attr_wait_spin.attr,
+	&dev_attr_wait_sleep.attr,
+	&dev_attr_wait_timeout.attr,
+	&dev_attr_errors.attr,
+	&dev_attr_recoveries.attr,
+	&dev_attr_recovery_us.attr,
+	&dev_attr_windows.attr,
+	&dev_attr_new_window.attr,
+	&dev_attr_remove_window.attr,
+	NULL,
+};
+
+static const struct attribute_group pchar_dev_group = {
+	.name	= "pci_char",
+	.attrs	= pchar_dev_attrs,
+};
+
+/*
+ * Resize the BARs that support it to the largest size not exceeding
+ * rebar_size, before they are claimed. Failures are not fatal, the
+ * BAR keeps the size it had.
+ */
+static void rebar_setup(struct pci_dev *pdev)
+{
+	u64 sizes;
+	int i, size, err;
+	u16 cmd;
+
+	if (!rebar_size)
+		return;
+
+	pci_read_config_word(pdev, PCI_COMMAND, &cmd);
+	pci_write_config_word(pdev, PCI_COMMAND, cmd & ~PCI_COMMAND_MEMORY);
+
+	for (i = 0; i < 6; i++) {
+		if (!(pci_resource_flags(pdev, i) & IORESOURCE_MEM))
+			continue;
+
+		/* bit n stands for 2^n MiB */
+		sizes = pchar_rebar_sizes(pdev, i);
+		sizes &= GENMASK_ULL(ilog2(rebar_size), 0);
+		if (!sizes)
+			continue;
+
+		size = fls64(sizes) - 1;
+		if (pci_resource_len(pdev, i) == (resource_size_t)SZ_1M << size)
+			continue;
+
+		err = pchar_resize_bar(pdev, i, size);
+		if (err)
+			dev_warn(&pdev->dev,
+				 "bar%d: resize to %llu MiB failed: %d\n",
+				 i, 1ULL << size, err);
+		else
+			dev_info(&pdev->dev, "bar%d: resized to %llu MiB\n",
+				 i, 1ULL << size);
+	}
+
+	pchar_assign_bars(pdev);
+	pci_write_config_word(pdev, PCI_COMMAND, cmd);
+}
+
+/*
+ * Let the device issue AtomicOps to host memory, for each completer
+ * size the root port and every switch on the way support. Without
+ * any the device just cannot use them, which is not fatal.
+ */
+static void atomic_setup(struct pci_char *pchar)
+{
+	static const u32 caps[] = {
+		PCI_EXP_DEVCAP2_ATOMIC_COMP32,
+		PCI_EXP_DEVCAP2_ATOMIC_COMP64,
+		PCI_EXP_DEVCAP2_ATOMIC_COMP128,
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pchar->atomic_lock); i++)
+		spin_lock_init(&pchar->atomic_lock[i]);
+
+	for (i = 0; i < ARRAY_SIZE(caps); i++)
+		if (!pci_enable_atomic_ops_to_root(pchar->pdev, caps[i]))
+			pchar->atomic_caps |= caps[i];
+}
+
+/*
+ * Hand BARs to the P2PDMA allocator. User space maps them through
+ * p2pmem/allocate of the PCI device, and buffers there can be used
+ * for O_DIRECT I/O that an NVMe controller DMAs straight into. The
+ * allocator releases the BARs itself when the driver is unbound.
+ */
+static void p2p_setup(struct pci_char *pchar)
+{
+#ifdef PCHAR_P2PDMA
+	struct pci_dev *pdev = pchar->pdev;
+	bool published = false;
+	int i, err;
+
+	for (i = 0; i < 6; i++) {
+		if (!pchar->bar[i].len || !(p2p_bars & (1 << i)))
+			continue;
+
+		if (!(pci_resource_flags(pdev, i) & IORESOURCE_PREFETCH)) {
+			dev_warn(&pdev->dev, "bar%d is not prefetchable, "
+				 "not using it for P2PDMA\n", i);
+			continue;
+		}
+
+		err = pci_p2pdma_add_resource(pdev, i, 0, 0);
+		if (err) {
+			dev_warn(&pdev->dev, "bar%d P2PDMA setup failed: %d\n",
+				 i, err);
+			continue;
+		}
+		published = true;
+	}
+
+	if (published)
+		pci_p2pmem_publish(pdev, true);
+#else
+	if (p2p_bars)
+		dev_warn(&pchar->pdev->dev, "P2PDMA is not supported\n");
+#endif
+}
+
+/*
+ * Refresh the status page from the per CPU counters. There is a single
+ * writer, so a bare sequence count is enough: odd while the fields are
+ * inconsistent, readers retry as documented in pci-char.h.
+ */
+static void status_update(struct pci_char *pchar)
+{
+	struct pchar_status_page *st = pchar->status;
+	u64 ev[EV_NR] = {};
+	unsigned int i, nr;
+	u16 lnksta;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < EV_NR; i++)
+			ev[i] += per_cpu_ptr(pchar->stats, cpu)->ev[i];
+
+	/* all ones when the device is gone */
+	if (pcie_capability_read_word(pchar->pdev, PCI_EXP_LNKSTA, &lnksta) ||
+	    lnksta == 0xffff)
+		lnksta = 0;
+
+	nr = min_t(unsigned int, pchar->nr_irqs, STATUS_MAX_IRQS);
+
+	WRITE_ONCE(st->seq, st->seq + 1);
+	smp_wmb();
+
+	st->updated_ns = ktime_get_ns();
+	st->reset_ns = READ_ONCE(pchar->reset_ns);
+	st->link_speed = lnksta & PCI_EXP_LNKSTA_CLS;
+	st->link_width = (lnksta & PCI_EXP_LNKSTA_NLW) >>
+			 PCI_EXP_LNKSTA_NLW_SHIFT;
+	st->mmio_reads = ev[EV_READS];
+	st->mmio_writes = ev[EV_WRITES];
+	st->read_bytes = ev[EV_RD_BYTES];
+	st->write_bytes = ev[EV_WR_BYTES];
+	st->dma_bytes = ev[EV_DMA_BYTES];
+	st->wait_timeouts = atomic64_read(&pchar->wait_timeout);
+	st->errors = atomic64_read(&pchar->errors);
+	st->recoveries = atomic64_read(&pchar->recoveries);
+	st->recovery_ns = READ_ONCE(pchar->recovery_ns);
+	st->nr_irqs = nr;
+	for (i = 0; i < nr; i++)
+		st->irqs[i] = atomic64_read(&pchar->irq[i].count);
+
+	smp_wmb();
+	WRITE_ONCE(st->seq, st->seq + 1);
+}
+
+static void status_work(struct work_struct *work)
+{
+	struct pci_char *pchar = container_of(to_delayed_work(work),
+					      struct pci_char, status_work);
+
+	status_update(pchar);
+	schedule_delayed_work(&pchar->status_work,
+			      msecs_to_jiffies(max(READ_ONCE(status_ms), 10U)));
+}
+
+#ifdef CONFIG_PERF_EVENTS
+/*
+ * perf PMU per device. The driver events count what all CPUs did to
+ * the device, like uncore PMUs they are only counted on one CPU and
+ * cannot sample; perf record reads them along with a sampling leader.
+ * The register event reads a free running 32 bit counter of the device
+ * on every update.
+ */
+#define PMU_EVENT(cfg)	((cfg) & 0xff)
+#define PMU_BAR(cfg)	(((cfg) >> 8) & 0x7)
+
+static struct pci_char *pmu_to_pchar(struct pmu *pmu)
+{
+	return container_of(pmu, struct pci_char, pmu);
+}
+
+static u64 pmu_value(struct perf_event *event)
+{
+	struct pci_char *pchar = pmu_to_pchar(event->pmu);
+	u64 cfg = event->attr.config;
+	unsigned int ev = PMU_EVENT(cfg);
+	u64 sum = 0;
+	int cpu;
+	u32 val;
+
+	/*
+	 * May be called in atomic context, so no gate, just the state. A
+	 * device that dropped off before error handling caught up reads
+	 * all ones, that is no progress either.
+	 */
+	if (ev == EV_REG) {
+		if (READ_ONCE(pchar->state) != DEV_LIVE)
+			return local64_read(&event->hw.prev_count);
+		val = readl(pchar->bar[PMU_BAR(cfg)].addr +
+			    event->attr.config1);
+		if (val == ~0U)
+			return local64_read(&event->hw.prev_count);
+		return val;
+	}
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(pchar->stats, cpu)->ev[ev];
+	return sum;
+}
+
+static void pmu_update(struct perf_event *event)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	u64 prev, now, delta;
+
+	do {
+		prev = local64_read(&hwc->prev_count);
+		now = pmu_value(event);
+	} while (local64_cmpxchg(&hwc->prev_count, prev, now) != prev);
+
+	delta = now - prev;
+	if (PMU_EVENT(event->attr.config) == EV_REG)
+		delta = (u32)delta;	/* the register wraps at 32 bits */
+	local64_add(delta, &event->count);
+}
+
+static int pmu_event_init(struct perf_event *event)
+{
+	struct pci_char *pchar = pmu_to_pchar(event->pmu);
+	u64 cfg = event->attr.config;
+	u64 off = event->attr.config1;
+	struct bar_t *bar;
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	if (is_sampling_event(event) ||
+	    event->attach_state & PERF_ATTACH_TASK || event->cpu < 0)
+		return -EINVAL;
+
+	if (PMU_EVENT(cfg) == EV_REG) {
+		bar = &pchar->bar[PMU_BAR(cfg)];
+		if (PMU_BAR(cfg) > 5 || off % 4 ||
+		    bar_check_bounds(bar, off, 4))
+			return -EINVAL;
+		if (policy_check(bar, off, 4, false))
+			return -EPERM;
+	} else if (PMU_EVENT(cfg) >= EV_NR) {
+		return -EINVAL;
+	}
+
+	event->cpu = pchar->pmu_cpu;
+	return 0;
+}
+
+static void pmu_start(struct perf_event *event, int flags)
+{
+	local64_set(&event->hw.prev_count, pmu_value(event));
+	event->hw.state = 0;
+}
+
+static void pmu_stop(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+
+	if (hwc->state & PERF_HES_STOPPED)
+		return;
+
+	pmu_update(event);
+	hwc->state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int pmu_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START)
+		pmu_start(event, PERF_EF_RELOAD);
+
+	return 0;
+}
+
+static void pmu_del(struct perf_event *event, int flags)
+{
+	pmu_stop(event, PERF_EF_UPDATE);
+}
+
+static ssize_t cpumask_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct pci_char *pchar = pmu_to_pchar(dev_get_drvdata(dev));
+
+	return sprintf(buf, "%d\n", pchar->pmu_cpu);
+}
+static DEVICE_ATTR_RO(cpumask);
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+PMU_FORMAT_ATTR(bar, "config:8-10");
+PMU_FORMAT_ATTR(offset, "config1:0-39");
+
+static struct attribute *pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	&format_attr_bar.attr,
+	&format_attr_offset.attr,
+	NULL,
+};
+
+PMU_EVENT_ATTR_STRING(reads, pmu_ev_reads, "event=0x00");
+PMU_EVENT_ATTR_STRING(writes, pmu_ev_writes, "event=0x01");
+PMU_EVENT_ATTR_STRING(read_bytes, pmu_ev_rd_bytes, "event=0x02");
+PMU_EVENT_ATTR_STRING(write_bytes, pmu_ev_wr_bytes, "event=0x03");
+PMU_EVENT_ATTR_STRING(interrupts, pmu_ev_irqs, "event=0x04");
+PMU_EVENT_ATTR_STRING(dma_bytes, pmu_ev_dma_bytes, "event=0x05");
+PMU_EVENT_ATTR_STRING(counter, pmu_ev_reg, "event=0x10,bar=?,offset=?");
+
+static struct attribute *pmu_event_attrs[] = {
+	&pmu_ev_reads.attr.attr,
+	&pmu_ev_writes.attr.attr,
+	&pmu_ev_rd_bytes.attr.attr,
+	&pmu_ev_wr_bytes.attr.attr,
+	&pmu_ev_irqs.attr.attr,
+	&pmu_ev_dma_bytes.attr.attr,
+	&pmu_ev_reg.attr.attr,
+	NULL,
+};
+
+static struct attribute *pmu_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL,
+};
+
+static const struct attribute_group pmu_format_group = {
+	.name = "format",
+	.attrs = pmu_format_attrs,
+};
+
+static const struct attribute_group pmu_events_group = {
+	.name = "events",
+	.attrs = pmu_event_attrs,
+};
+
+static const struct attribute_group pmu_group = {
+	.attrs = pmu_attrs,
+};
+
+static const struct attribute_group *pmu_groups[] = {
+	&pmu_format_group,
+	&pmu_events_group,
+	&pmu_group,
+	NULL,
+};
+
+static int pmu_hp_state;
+
+/* Move the events off a CPU going down, to one near the device if any */
+static int pmu_cpu_offline(unsigned int cpu, struct hlist_node *node)
+{
+	struct pci_char *pchar = hlist_entry_safe(node, struct pci_char,
+						  pmu_node);
+	int node_id = dev_to_node(&pchar->pdev->dev);
+	unsigned int target;
+
+	if (cpu != pchar->pmu_cpu)
+		return 0;
+
+	for_each_cpu_and(target, cpumask_of_node(node_id), cpu_online_mask)
+		if (target != cpu)
+			break;
+	if (target >= nr_cpu_ids)
+		target = cpumask_any_but(cpu_online_mask, cpu);
+	if (target >= nr_cpu_ids)
+		return 0;
+
+	perf_pmu_migrate_context(&pchar->pmu, cpu, target);
+	WRITE_ONCE(pchar->pmu_cpu, target);
+
+	return 0;
+}
+
+static void pmu_init(void)
+{
+	int ret;
+
+	ret = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN,
+				      "perf/pci-char:online", NULL,
+				      pmu_cpu_offline);
+	if (ret < 0)
+		pr_warn("pci-char: perf CPU hotplug state failed: %d\n", ret);
+	else
+		pmu_hp_state = ret;
+}
+
+static void pmu_exit(void)
+{
+	if (pmu_hp_state)
+		cpuhp_remove_multi_state(pmu_hp_state);
+}
+
+/* perf support is an extra, the device works on without it */
+static void pmu_setup(struct pci_char *pchar)
+{
+	struct pci_dev *pdev = pchar->pdev;
+	struct device *dev = &pdev->dev;
+	int err;
+
+	snprintf(pchar->pmu_name, sizeof(pchar->pmu_name),
+		 "pchar_%02x_%02x_%x", pdev->bus->number,
+		 PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn));
+
+	/* a CPU close to the device, register reads cross less fabric */
+	/* without the hotplug state the events could not leave a dying CPU */
+	if (!pmu_hp_state)
+		return;
+
+	cpus_read_lock();
+	pchar->pmu_cpu = cpumask_any_and(cpumask_of_node(dev_to_node(dev)),
+					 cpu_online_mask);
+	if (pchar->pmu_cpu >= nr_cpu_ids)
+		pchar->pmu_cpu = cpumask_first(cpu_online_mask);
+	cpuhp_state_add_instance_nocalls_cpuslocked(pmu_hp_state,
+						    &pchar->pmu_node);
+	cpus_read_unlock();
+
+	pchar->pmu = (struct pmu) {
+		.module		= THIS_MODULE,
+		.attr_groups	= pmu_groups,
+		.task_ctx_nr	= perf_invalid_context,
+		.capabilities	= PERF_PMU_CAP_NO_EXCLUDE,
+		.event_init	= pmu_event_init,
+		.add		= pmu_add,
+		.del		= pmu_del,
+		.start		= pmu_start,
+		.stop		= pmu_stop,
+		.read		= pmu_update,
+	};
+
+	err = perf_pmu_register(&pchar->pmu, pchar->pmu_name, -1);
+	if (err) {
+		dev_warn(dev, "perf PMU registration failed: %d\n", err);
+		cpuhp_state_remove_instance_nocalls(pmu_hp_state,
+						    &pchar->pmu_node);
+		return;
+	}
+
+	pchar->pmu_registered = true;
+}
+
+static void pmu_teardown(struct pci_char *pchar)
+{
+	if (!pchar->pmu_registered)
+		return;
+
+	cpuhp_state_remove_instance_nocalls(pmu_hp_state, &pchar->pmu_node);
+	perf_pmu_unregister(&pchar->pmu);
+}
+#else
+static void pmu_init(void)
+{
+}
+
+static void pmu_exit(void)
+{
+}
+
+static void pmu_setup(struct pci_char *pchar)
+{
+}
+
+static void pmu_teardown(struct pci_char *pchar)
+{
+}
+#endif
+
+#ifdef PCHAR_BLK
+/*
+ * Requests are copied synchronously, a request is small enough for
+ * that and the hardware queues of all CPUs copy in parallel.
+ */
+static blk_status_t disk_queue_rq(struct blk_mq_hw_ctx *hctx,
+				  const struct blk_mq_queue_data *bd)
+{
+	struct pchar_disk *pd = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
+	struct bar_t *bar = pd->bar;
+	bool write = req_op(rq) == REQ_OP_WRITE;
+	loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	size_t len = blk_rq_bytes(rq);
+	struct req_iterator iter;
+	struct bio_vec bv;
+	void *buf;
+	int err;
+
+	if (!write && req_op(rq) != REQ_OP_READ)
+		return BLK_STS_NOTSUPP;
+
+	/* queues are quiesced during error recovery, this is for good */
+	if (READ_ONCE(pd->pchar->state) != DEV_LIVE)
+		return BLK_STS_IOERR;
+
+	if (pos + len > bar->len)
+		return BLK_STS_IOERR;
+
+	if (policy_check(bar, pos, len, write))
+		return BLK_STS_IOERR;
+
+	blk_mq_start_request(rq);
+
+	rq_for_each_segment(bv, rq, iter) {
+		buf = bvec_kmap_local(&bv);
+		if (write) {
+			memcpy_toio(bar->addr + pos, buf, bv.bv_len);
+			err = 0;
+		} else {
+			memcpy_fromio(buf, bar->addr + pos, bv.bv_len);
+			/* a gone device reads all ones, one word tells */
+			err = dev_check(pd->pchar, *(u32 *)buf);
+		}
+		kunmap_local(buf);
+		bar_stat(bar, write, 1, bv.bv_len);
+		if (err == -EAGAIN) {
+			/* runs again once recovery unquiesces the queue */
+			blk_mq_requeue_request(rq, true);
+			return BLK_STS_OK;
+		}
+		if (err) {
+			blk_mq_end_request(rq, BLK_STS_IOERR);
+			return BLK_STS_OK;
+		}
+		pos += bv.bv_len;
+	}
+
+	if (write)
+		cache_invalidate(bar, blk_rq_pos(rq) << SECTOR_SHIFT, len);
+
+	blk_mq_end_request(rq, BLK_STS_OK);
+	return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops disk_mq_ops = {
+	.queue_rq = disk_queue_rq,
+};
+
+static const struct block_device_operations disk_fops = {
+	.owner = THIS_MODULE,
+};
+
+static void disk_free(struct pchar_disk *pd)
+{
+	if (!pd)
+		return;
+
+	del_gendisk(pd->disk);
+	pchar_cleanup_disk(pd->disk);
+	blk_mq_free_tag_set(&pd->tags);
+	kfree(pd);
+}
+
+static int disk_add(struct pci_char *pchar, int i)
+{
+	struct pci_dev *pdev = pchar->pdev;
+	struct queue_limits lim = {
+		.logical_block_size = SECTOR_SIZE,
+		.max_hw_sectors = DISK_MAX_SECTORS,
+	};
+	struct bar_t *bar = &pchar->bar[i];
+	struct pchar_disk *pd;
+	struct bar_policy *p;
+	int err;
+
+	pd = kzalloc(sizeof(*pd), GFP_KERNEL);
+	if (!pd)
+		return -ENOMEM;
+
+	pd->bar = bar;
+	pd->pchar = pchar;
+	pd->tags.ops = &disk_mq_ops;
+	pd->tags.nr_hw_queues = num_possible_cpus();
+	pd->tags.queue_depth = DISK_DEPTH;
+	pd->tags.numa_node = dev_to_node(&pdev->dev);
+	err = blk_mq_alloc_tag_set(&pd->tags);
+	if (err)
+		goto failure_tags;
+
+	pd->disk = pchar_alloc_disk(&pd->tags, &lim, pd);
+	if (IS_ERR(pd->disk)) {
+		err = PTR_ERR(pd->disk);
+		goto failure_disk;
+	}
+
+	pd->disk->fops = &disk_fops;
+	pd->disk->private_data = pd;
+	snprintf(pd->disk->disk_name, DISK_NAME_LEN, "pchar_%02x_%02x_%x_bar%d",
+		 pdev->bus->number, PCI_SLOT(pdev->devfn),
+		 PCI_FUNC(pdev->devfn), i);
+	set_capacity(pd->disk, bar->len >> SECTOR_SHIFT);
+
+	/* the disk spans the BAR, requests are checked against the policy */
+	rcu_read_lock();
+	p = rcu_dereference(bar->policy);
+	set_disk_ro(pd->disk, p && p->ro);
+	rcu_read_unlock();
+
+	err = add_disk(pd->disk);
+	if (err)
+		goto failure_add;
+
+	pchar->disk[i] = pd;
+	return 0;
+
+failure_add:
+	pchar_cleanup_disk(pd->disk);
+failure_disk:
+	blk_mq_free_tag_set(&pd->tags);
+failure_tags:
+	kfree(pd);
+	return err;
+}
+#else
+static void disk_free(struct pchar_disk *pd)
+{
+}
+#endif
+
+/* Hold block requests back while the device recovers */
+static void disk_quiesce(struct pci_char *pchar, bool on)
+{
+#ifdef PCHAR_BLK
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		if (!pchar->disk[i])
+			continue;
+		if (on)
+			blk_mq_quiesce_queue(pchar->disk[i]->disk->queue);
+		else
+			blk_mq_unquiesce_queue(pchar->disk[i]->disk->queue);
+	}
+#endif
+}
+
+/* Block devices are an extra, the device works on without them */
+static void disk_setup(struct pci_char *pchar)
+{
+	struct device *dev = &pchar->pdev->dev;
+	int i, err;
+
+	for (i = 0; i < 6; i++) {
+		if (!pchar->bar[i].len || !(disk_bars & (1 << i)))
+			continue;
+
+#ifdef PCHAR_BLK
+		if (pchar->bar[i].len < PAGE_SIZE)
+			err = -EINVAL;
+		else
+			err = disk_add(pchar, i);
+#else
+		err = -EOPNOTSUPP;
+#endif
+		if (err)
+			dev_warn(dev, "bar%d block device failed: %d\n", i, err);
+	}
+}
+
+/* Unmap [start, end) of the mmap space of all nodes */
+static void zap_mappings(struct pci_char *pchar, loff_t start, loff_t end)
+{
+	unsigned int i;
+
+	for (i = 0; i < FUNC_MINOR; i++)
+		if (pchar->bar[i].mapping)
+			unmap_mapping_range(pchar->bar[i].mapping, start,
+					    end - start, 1);
+	if (pchar->func_mapping)
+		unmap_mapping_range(pchar->func_mapping, start, end - start,
+				    1);
+}
+
+/*
+ * Stop all access to the device: sleeping waiters are kicked, running
+ * system calls drained, user mappings fault again and block requests
+ * are held back. Open files and nodes stay as they are.
+ */
+static void err_pause(struct pci_char *pchar, enum dev_state state)
+{
+	unsigned int i;
+
+	/* a dead device stays dead, it may only be paused later */
+	if (READ_ONCE(pchar->state) == DEV_DEAD)
+		state = DEV_DEAD;
+
+	if (pchar->paused) {
+		if (state == DEV_DEAD)
+			dev_mark_dead(pchar);
+		return;
+	}
+
+	pchar->paused = true;
+	pchar->reset_start = ktime_get_ns();
+	WRITE_ONCE(pchar->state, state);
+	wake_up_all(&pchar->state_wq);
+	for (i = 0; i < pchar->nr_irqs; i++)
+		wake_up_all(&pchar->irq[i].wq);
+
+	down_write(&pchar->io_rwsem);
+	up_write(&pchar->io_rwsem);
+
+	/* BAR offsets only, the other mappings are not faulted in */
+	zap_mappings(pchar, 0, PCHAR_STATUS_MMAP);
+	disk_quiesce(pchar, true);
+	err_notify(pchar);
+}
+
+static void err_resume(struct pci_char *pchar)
+{
+	unsigned int i;
+
+	if (!pchar->paused || READ_ONCE(pchar->state) != DEV_RESET)
+		return;
+
+	/* the device is back at its reset values */
+	for (i = 0; i < FUNC_MINOR; i++)
+		if (pchar->bar[i].len)
+			cache_invalidate(&pchar->bar[i], 0, pchar->bar[i].len);
+
+	WRITE_ONCE(pchar->recovery_ns, ktime_get_ns() - pchar->reset_start);
+	WRITE_ONCE(pchar->reset_ns, ktime_get_real_ns());
+	atomic64_inc(&pchar->recoveries);
+
+	pchar->paused = false;
+	WRITE_ONCE(pchar->state, DEV_LIVE);
+	wake_up_all(&pchar->state_wq);
+	disk_quiesce(pchar, false);
+	err_notify(pchar);
+
+	dev_info(&pchar->pdev->dev, "recovered in %llu us\n",
+		 pchar->recovery_ns / NSEC_PER_USEC);
+}
+
+static pci_ers_result_t pchar_error_detected(struct pci_dev *pdev,
+					     pci_channel_state_t state)
+{
+	struct pci_char *pchar = pci_get_drvdata(pdev);
+
+	atomic64_inc(&pchar->errors);
+	dev_warn(&pdev->dev, "PCIe error detected\n");
+
+	/* a device found gone before cannot be reset back */
+	if (state == pci_channel_io_perm_failure ||
+	    READ_ONCE(pchar->state) == DEV_DEAD) {
+		err_pause(pchar, DEV_DEAD);
+		return PCI_ERS_RESULT_DISCONNECT;
+	}
+
+	err_pause(pchar, DEV_RESET);
+	return PCI_ERS_RESULT_NEED_RESET;
+}
+
+/* Config space and MSI-X come back, the BARs stay where they were */
+static pci_ers_result_t pchar_slot_reset(struct pci_dev *pdev)
+{
+	pci_restore_state(pdev);
+	pci_save_state(pdev);
+
+	return PCI_ERS_RESULT_RECOVERED;
+}
+
+static void pchar_resume(struct pci_dev *pdev)
+{
+	err_resume(pci_get_drvdata(pdev));
+}
+
+/* Resets through sysfs or other drivers pause the same way */
+static void pchar_reset_prepare(struct pci_dev *pdev)
+{
+	err_pause(pci_get_drvdata(pdev), DEV_RESET);
+}
+
+static void pchar_reset_done(struct pci_dev *pdev)
+{
+	err_resume(pci_get_drvdata(pdev));
+}
+
+static const struct pci_error_handlers pchar_err_handler = {
+	.error_detected	= pchar_error_detected,
+	.slot_reset	= pchar_slot_reset,
+	.resume		= pchar_resume,
+	.reset_prepare	= pchar_reset_prepare,
+	.reset_done	= pchar_reset_done,
 };
 
 static int pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
@@ -198,16 +5300,43 @@ static int pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	struct device *dev;
 	dev_t dev_num;
 
-	pchar = kmalloc(sizeof(struct pci_char), GFP_KERNEL);
+	pchar = kzalloc(sizeof(struct pci_char), GFP_KERNEL);
 	if (!pchar) {
 		err = -ENOMEM;
 		goto failure_kmalloc;
 	}
 
+	kref_init(&pchar->ref);
+	pchar->pdev = pci_dev_get(pdev);
+	mutex_init(&pchar->cfg_lock);
+	mutex_init(&pchar->win_lock);
+	mutex_init(&pchar->files_lock);
+	INIT_LIST_HEAD(&pchar->files);
+	init_rwsem(&pchar->io_rwsem);
+	init_waitqueue_head(&pchar->state_wq);
+	spin_lock_init(&pchar->err_lock);
+
+	pchar->stats = alloc_percpu(struct pchar_stats);
+	pchar->status = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!pchar->stats || !pchar->status) {
+		err = -ENOMEM;
+		goto failure_pci_enable;
+	}
+	pchar->status->version = PCHAR_STATUS_VERSION;
+	pchar->reset_ns = ktime_get_real_ns();
+	INIT_DELAYED_WORK(&pchar->status_work, status_work);
+
+	rebar_setup(pdev);
+
 	err = pci_enable_device_mem(pdev);
 	if (err)
 		goto failure_pci_enable;
 
+	/* DMA is only used by streams, a device without works on */
+	if (dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64)) &&
+	    dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32)))
+		dev_warn(&pdev->dev, "no usable DMA mask\n");
+
 	/* Request only the BARs that contain memory regions */
 	mem_bars = pci_select_bars(pdev, IORESOURCE_MEM);
 	err = pci_request_selected_regions(pdev, mem_bars, "pci-char");
@@ -217,13 +5346,27 @@ static int pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	/* Memory Map BARs for MMIO */
 	for (i = 0; i < 6; i++) {
 		if (mem_bars & (1 << i)) {
-			pchar->bar[i].addr = ioremap(pci_resource_start(pdev, i),
-						     pci_resource_len(pdev, i));
+			/* memory-like BARs on request write combining */
+			pchar->bar[i].wc = wc_bars & (1 << i) &&
+					   pci_resource_flags(pdev, i) &
+					   IORESOURCE_PREFETCH;
+			if (pchar->bar[i].wc)
+				pchar->bar[i].addr =
+					ioremap_wc(pci_resource_start(pdev, i),
+						   pci_resource_len(pdev, i));
+			else
+				pchar->bar[i].addr =
+					ioremap(pci_resource_start(pdev, i),
+						pci_resource_len(pdev, i));
 			if (IS_ERR(pchar->bar[i].addr)) {
 				err = PTR_ERR(pchar->bar[i].addr);
 				break;
-			} else
+			} else {
 				pchar->bar[i].len = pci_resource_len(pdev, i);
+				pchar->bar[i].phys = pci_resource_start(pdev, i);
+				pchar->bar[i].parent = i;
+				pchar->bar[i].stats = pchar->stats;
+			}
 		} else {
 			pchar->bar[i].addr = NULL;
 			pchar->bar[i].len = 0;
@@ -237,31 +5380,66 @@ static int pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto failure_ioremap;
 	}
 
+	/* Apply the read-only policy requested at module load */
+	for (i = 0; i < 6; i++) {
+		struct bar_policy *p;
+
+		if (!pchar->bar[i].len || !(ro_bars & (1 << i)))
+			continue;
+
+		p = kzalloc(sizeof(*p), GFP_KERNEL);
+		if (!p) {
+			err = -ENOMEM;
+			goto failure_policy;
+		}
+		p->ro = true;
+		RCU_INIT_POINTER(pchar->bar[i].policy, p);
+	}
+
+	err = exec_start(pchar, pdev);
+	if (err)
+		goto failure_exec;
+
+	atomic_setup(pchar);
+	p2p_setup(pchar);
+
+	err = irq_setup(pchar);
+	if (err)
+		goto failure_irq;
+
 	/* Get device number range */
-	err = alloc_chrdev_region(&dev_num, 0, 6, "pci-char");
+	err = alloc_chrdev_region(&dev_num, 0, NR_MINORS, "pci-char");
 	if (err)
 		goto failure_alloc_chrdev_region;
 
 	pchar->major = MAJOR(dev_num);
 
-	/* connect cdev with file operations */
-	cdev_init(&pchar->cdev, &fops);
-	pchar->cdev.owner = THIS_MODULE;
+	/* connect cdev with file operations, open files hold on to it */
+	pchar->cdev = cdev_alloc();
+	if (!pchar->cdev) {
+		err = -ENOMEM;
+		goto failure_cdev_add;
+	}
+	pchar->cdev->ops = &fops;
+	pchar->cdev->owner = THIS_MODULE;
 
 	/* add major/min range to cdev */
-	err = cdev_add(&pchar->cdev, MKDEV(pchar->major, 0), 6);
+	err = cdev_add(pchar->cdev, MKDEV(pchar->major, 0), NR_MINORS);
 	if (err)
-		goto failure_cdev_add;
+		goto failure_device_create;
 
 	/* create /dev/ nodes via udev */
 	for (i = 0; i < 6; i++) {
 		if (pchar->bar[i].len) {
-			dev = device_create(pchar_class, &pdev->dev,
-					    MKDEV(pchar->major, i),
-					    NULL, "b%xd%xf%x_bar%d",
-					    pdev->bus->number,
-					    PCI_SLOT(pdev->devfn),
-					    PCI_FUNC(pdev->devfn), i);
+			dev = device_create_with_groups(pchar_class,
+							&pdev->dev,
+							MKDEV(pchar->major, i),
+							pchar, bar_groups,
+							"b%xd%xf%x_bar%d",
+							pdev->bus->number,
+							PCI_SLOT(pdev->devfn),
+							PCI_FUNC(pdev->devfn),
+							i);
 			if (IS_ERR(dev)) {
 				err = PTR_ERR(dev);
 				break;
@@ -277,21 +5455,66 @@ static int pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto failure_device_create;
 	}
 
+	/* one more node reaching all BARs of the function */
+	dev = device_create(pchar_class, &pdev->dev,
+			    MKDEV(pchar->major, FUNC_MINOR), pchar,
+			    "b%xd%xf%x", pdev->bus->number,
+			    PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn));
+	if (IS_ERR(dev)) {
+		err = PTR_ERR(dev);
+		goto failure_func_create;
+	}
+
 	pci_set_drvdata(pdev, pchar);
+
+	err = sysfs_create_group(&pdev->dev.kobj, &pchar_dev_group);
+	if (err)
+		goto failure_sysfs;
+
+	disk_setup(pchar);
+	pmu_setup(pchar);
+	status_work(&pchar->status_work.work);
+
+	/* restored after error recovery */
+	pci_save_state(pdev);
+
+	mutex_lock(&pchar_list_lock);
+	list_add(&pchar->node, &pchar_list);
+	mutex_unlock(&pchar_list_lock);
+
 	dev_info(&pdev->dev, "claimed by pci-char\n");
 
 	return 0;
 
+failure_sysfs:
+	device_destroy(pchar_class, MKDEV(pchar->major, FUNC_MINOR));
+
+failure_func_create:
+	for (i = 0; i < 6; i++)
+		if (pchar->bar[i].len)
+			device_destroy(pchar_class,
+				       MKDEV(pchar->major, i));
+
 failure_device_create:
-	cdev_del(&pchar->cdev);
+	cdev_del(pchar->cdev);
 
 failure_cdev_add:
-	unregister_chrdev_region(MKDEV(pchar->major, 0), 6);
+	unregister_chrdev_region(MKDEV(pchar->major, 0), NR_MINORS);
 
 failure_alloc_chrdev_region:
-	for (i = 0; i < 6; i++)
+	irq_teardown(pchar);
+	kfree(pchar->irq);
+
+failure_irq:
+	exec_stop(pchar);
+
+failure_exec:
+failure_policy:
+	for (i = 0; i < 6; i++) {
+		kfree(rcu_access_pointer(pchar->bar[i].policy));
 		if (pchar->bar[i].len)
 			iounmap(pchar->bar[i].addr);
+	}
 
 failure_ioremap:
 	pci_release_selected_regions(pdev,
@@ -301,6 +5524,9 @@ failure_pci_regions:
 	pci_disable_device(pdev);
 
 failure_pci_enable:
+	free_page((unsigned long)pchar->status);
+	free_percpu(pchar->stats);
+	pci_dev_put(pdev);
 	kfree(pchar);
 
 failure_kmalloc:
@@ -311,15 +5537,52 @@ static void pci_remove(struct pci_dev *pdev)
 {
 	int i;
 	struct pci_char *pchar = pci_get_drvdata(pdev);
+	bool present = pci_device_is_present(pdev);
+	struct pchar_file *pf;
+
+	/* no new opens, open files keep pchar until they are released */
+	mutex_lock(&pchar_list_lock);
+	list_del(&pchar->node);
+	mutex_unlock(&pchar_list_lock);
+
+	pmu_teardown(pchar);
+	cancel_delayed_work_sync(&pchar->status_work);
+
+	/* fail whatever still comes in, block requests included */
+	err_pause(pchar, DEV_DEAD);
+	disk_quiesce(pchar, false);
 
 	for (i = 0; i < 6; i++)
+		disk_free(pchar->disk[i]);
+
+	/* streams of open files stop, their timers included */
+	mutex_lock(&pchar->files_lock);
+	list_for_each_entry(pf, &pchar->files, node) {
+		mutex_lock(&pf->lock);
+		stream_detach(pf->capture, present);
+		stream_detach(pf->playback, present);
+		mutex_unlock(&pf->lock);
+	}
+	mutex_unlock(&pchar->files_lock);
+
+	/* doorbells are mapped up front, not faulted in */
+	zap_mappings(pchar, PCHAR_DB_MMAP_BASE, PCHAR_CAPTURE_MMAP_STATUS);
+
+	sysfs_remove_group(&pdev->dev.kobj, &pchar_dev_group);
+
+	device_destroy(pchar_class, MKDEV(pchar->major, FUNC_MINOR));
+	for (i = 0; i < FUNC_MINOR; i++)
 		if (pchar->bar[i].len)
 			device_destroy(pchar_class,
 				       MKDEV(pchar->major, i));
 
-	cdev_del(&pchar->cdev);
+	cdev_del(pchar->cdev);
 
-	unregister_chrdev_region(MKDEV(pchar->major, 0), 6);
+	unregister_chrdev_region(MKDEV(pchar->major, 0), NR_MINORS);
+
+	irq_teardown(pchar);
+	exec_stop(pchar);
+	exec_fail(pchar);
 
 	for (i = 0; i < 6; i++)
 		if (pchar->bar[i].len)
@@ -328,7 +5591,7 @@ static void pci_remove(struct pci_dev *pdev)
 	pci_release_selected_regions(pdev,
 				     pci_select_bars(pdev, IORESOURCE_MEM));
 	pci_disable_device(pdev);
-	kfree(pchar);
+	kref_put(&pchar->ref, pchar_free);
 }
 
 static struct pci_driver pchar_driver = {
@@ -336,11 +5599,531 @@ static struct pci_driver pchar_driver = {
 	.id_table	= NULL,	/* only dynamic id's */
 	.probe		= pci_probe,
 	.remove         = pci_remove,
+	.err_handler	= &pchar_err_handler,
+};
+
+/*
+ * Simulated devices. A model server, e.g. an RTL simulation, creates
+ * one through the sim control node and answers the accesses to its
+ * BAR nodes, which are posted into a ring shared with the server. The
+ * caller busy waits for the answer for sim_spin_us and sleeps after,
+ * so that a polling server gets round trips of a few microseconds.
+ */
+struct pchar_sim {
+	struct kref ref;
+	unsigned int index;
+	resource_size_t len[6];
+	struct pchar_sim_ring *ring;	/* shared with the server */
+	size_t ring_size;
+	u32 nr_slots;
+	spinlock_t lock;	/* protects head, busy and abandoned */
+	u64 head;
+	unsigned long *busy;		/* slots waited for by a caller */
+	unsigned long *abandoned;	/* by a killed caller */
+	bool dead;			/* server is gone */
+	wait_queue_head_t srv_wq;	/* server waits for requests */
+	wait_queue_head_t cli_wq;	/* callers wait for answers or slots */
+};
+
+/* Control file of a server, or BAR of a simulated device */
+struct sim_file {
+	struct pchar_sim *sim;
+	unsigned int bar;
+};
+
+static struct pchar_sim *sims[SIM_MAX];
+static DEFINE_MUTEX(sim_lock);	/* protects sims */
+static dev_t sim_devt;
+static struct cdev sim_cdev;
+
+static void sim_free(struct kref *ref)
+{
+	struct pchar_sim *sim = container_of(ref, struct pchar_sim, ref);
+
+	vfree(sim->ring);
+	bitmap_free(sim->busy);
+	bitmap_free(sim->abandoned);
+	kfree(sim);
+}
+
+static bool sim_slot_free(struct pchar_sim *sim, unsigned int i)
+{
+	return !test_bit(i, sim->busy) ||
+	       (test_bit(i, sim->abandoned) &&
+		smp_load_acquire(&sim->ring->slot[i].done)) ||
+	       READ_ONCE(sim->dead);
+}
+
+/* Post one access and wait for the server to answer it */
+static int sim_access(struct pchar_sim *sim, unsigned int bar, u32 op,
+		      loff_t off, u32 *value)
+{
+	struct pchar_sim_slot *slot;
+	unsigned int i;
+	u64 until;
+	int err;
+
+	spin_lock(&sim->lock);
+	for (;;) {
+		if (sim->dead) {
+			spin_unlock(&sim->lock);
+			return -ENODEV;
+		}
+
+		i = sim->head & (sim->nr_slots - 1);
+		if (test_bit(i, sim->abandoned) &&
+		    smp_load_acquire(&sim->ring->slot[i].done)) {
+			clear_bit(i, sim->abandoned);
+			clear_bit(i, sim->busy);
+		}
+		if (!test_bit(i, sim->busy))
+			break;
+
+		/* more callers than slots, wait for the oldest */
+		WRITE_ONCE(sim->ring->slot[i].waiting, 1);
+		spin_unlock(&sim->lock);
+		smp_mb();
+		err = wait_event_killable(sim->cli_wq, sim_slot_free(sim, i));
+		if (err)
+			return err;
+		spin_lock(&sim->lock);
+	}
+
+	set_bit(i, sim->busy);
+	slot = &sim->ring->slot[i];
+	slot->offset = off;
+	slot->bar = bar;
+	slot->op = op;
+	slot->value = op == PCHAR_OP_WRITE ? *value : 0;
+	slot->done = 0;
+	slot->waiting = 0;
+	smp_store_release(&slot->seq, sim->head);
+	sim->head++;
+	WRITE_ONCE(sim->ring->head, sim->head);
+	spin_unlock(&sim->lock);
+
+	wake_up(&sim->srv_wq);
+
+	until = ktime_get_ns() + (u64)sim_spin_us * NSEC_PER_USEC;
+	while (!smp_load_acquire(&slot->done) && ktime_get_ns() < until &&
+	       !READ_ONCE(sim->dead))
+		cpu_relax();
+
+	if (!smp_load_acquire(&slot->done)) {
+		/* the server wakes us once it sees waiting after done */
+		WRITE_ONCE(slot->waiting, 1);
+		smp_mb();
+		err = wait_event_killable(sim->cli_wq,
+					  smp_load_acquire(&slot->done) ||
+					  READ_ONCE(sim->dead));
+		if (err) {
+			spin_lock(&sim->lock);
+			set_bit(i, sim->abandoned);
+			spin_unlock(&sim->lock);
+			return err;
+		}
+	}
+
+	err = smp_load_acquire(&slot->done) ? 0 : -ENODEV;
+	if (!err && op == PCHAR_OP_READ)
+		*value = slot->value;
+
+	spin_lock(&sim->lock);
+	clear_bit(i, sim->busy);
+	spin_unlock(&sim->lock);
+	if (wq_has_sleeper(&sim->cli_wq))
+		wake_up_all(&sim->cli_wq);
+
+	return err;
+}
+
+static int sim_open(struct inode *inode, struct file *file)
+{
+	unsigned int minor = iminor(inode);
+	struct pchar_sim *sim = NULL;
+	struct sim_file *sf;
+
+	sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+	if (!sf)
+		return -ENOMEM;
+
+	/* minor 0 is the control node, a server creates its device there */
+	if (minor) {
+		sf->bar = (minor - 1) % 6;
+		mutex_lock(&sim_lock);
+		sim = sims[(minor - 1) / 6];
+		if (sim && sim->len[sf->bar])
+			kref_get(&sim->ref);
+		else
+			sim = NULL;
+		mutex_unlock(&sim_lock);
+
+		if (!sim) {
+			kfree(sf);
+			return -ENODEV;
+		}
+	}
+
+	sf->sim = sim;
+	file->private_data = sf;
+
+	return 0;
+}
+
+static void sim_destroy(struct pchar_sim *sim)
+{
+	unsigned int i;
+
+	mutex_lock(&sim_lock);
+	sims[sim->index] = NULL;
+	mutex_unlock(&sim_lock);
+
+	for (i = 0; i < 6; i++)
+		if (sim->len[i])
+			device_destroy(pchar_class,
+				       MKDEV(MAJOR(sim_devt),
+					     1 + sim->index * 6 + i));
+
+	/* fail waiting and future accesses */
+	spin_lock(&sim->lock);
+	sim->dead = true;
+	spin_unlock(&sim->lock);
+	wake_up_all(&sim->cli_wq);
+}
+
+static int sim_release(struct inode *inode, struct file *file)
+{
+	struct sim_file *sf = file->private_data;
+
+	if (sf->sim) {
+		if (!iminor(inode))
+			sim_destroy(sf->sim);
+		kref_put(&sf->sim->ref, sim_free);
+	}
+	kfree(sf);
+
+	return 0;
+}
+
+static loff_t sim_seek(struct file *file, loff_t offset, int whence)
+{
+	struct sim_file *sf = file->private_data;
+
+	if (!iminor(file_inode(file)))
+		return -ESPIPE;
+
+	return seek_aligned(file, offset, whence, sf->sim->len[sf->bar]);
+}
+
+static ssize_t sim_rw(struct file *file, char __user *buf, size_t count,
+		      loff_t *ppos, bool write)
+{
+	struct sim_file *sf = file->private_data;
+	struct pchar_sim *sim = sf->sim;
+	loff_t pos = *ppos;
+	size_t done;
+	u32 val;
+	int err = 0;
+
+	if (!iminor(file_inode(file)))
+		return -EINVAL;
+
+	if (pos % 4 || count % 4 || pos < 0 || pos > sim->len[sf->bar] ||
+	    count > sim->len[sf->bar] - pos)
+		return -EINVAL;
+
+	for (done = 0; done < count; done += 4) {
+		if (write) {
+			if (get_user(val, (u32 __user *)(buf + done))) {
+				err = -EFAULT;
+				break;
+			}
+			err = sim_access(sim, sf->bar, PCHAR_OP_WRITE,
+					 pos + done, &val);
+		} else {
+			err = sim_access(sim, sf->bar, PCHAR_OP_READ,
+					 pos + done, &val);
+			if (!err && put_user(val, (u32 __user *)(buf + done)))
+				err = -EFAULT;
+		}
+		if (err)
+			break;
+	}
+
+	if (!done)
+		return err;
+
+	*ppos = pos + done;
+	return done;
+}
+
+static ssize_t sim_read(struct file *file, char __user *buf, size_t count,
+			loff_t *ppos)
+{
+	return sim_rw(file, buf, count, ppos, false);
+}
+
+static ssize_t sim_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	return sim_rw(file, (char __user *)buf, count, ppos, true);
+}
+
+static long sim_batch(struct file *file, struct pchar_batch __user *ub)
+{
+	struct sim_file *sf = file->private_data;
+	struct pchar_batch b;
+	struct pchar_op *ops;
+	size_t size, i;
+	int err = 0;
+
+	if (copy_from_user(&b, ub, sizeof(b)))
+		return -EFAULT;
+
+	if (b.nr_ops > MAX_OPS)
+		return -E2BIG;
+
+	size = b.nr_ops * sizeof(*ops);
+	ops = vmemdup_user(u64_to_user_ptr(b.ops), size);
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	for (i = 0; i < b.nr_ops && !err; i++) {
+		if (ops[i].bar != sf->bar || ops[i].offset % 4 ||
+		    ops[i].offset > sf->sim->len[sf->bar] - 4 ||
+		    ops[i].cmd > PCHAR_OP_WRITE)
+			err = -EINVAL;
+		else if (ops[i].cmd == PCHAR_OP_WRITE &&
+			 !(file->f_mode & FMODE_WRITE))
+			err = -EBADF;
+	}
+
+	for (i = 0; i < b.nr_ops && !err; i++)
+		err = sim_access(sf->sim, sf->bar, ops[i].cmd, ops[i].offset,
+				 &ops[i].value);
+
+	if (!err && copy_to_user(u64_to_user_ptr(b.ops), ops, size))
+		err = -EFAULT;
+
+	kvfree(ops);
+	return err;
+}
+
+static long sim_create(struct sim_file *sf, struct pchar_sim_create __user *uc)
+{
+	struct pchar_sim_create c;
+	struct pchar_sim *sim;
+	unsigned int i, idx;
+	struct device *dev;
+	int err;
+
+	if (copy_from_user(&c, uc, sizeof(c)))
+		return -EFAULT;
+
+	if (!is_power_of_2(c.nr_slots) || c.nr_slots > SIM_MAX_SLOTS)
+		return -EINVAL;
+
+	for (i = 0; i < 6; i++)
+		if (c.bar_len[i] % 4 ||
+		    c.bar_len[i] > BIT_ULL(PCHAR_FUNC_BAR_SHIFT))
+			return -EINVAL;
+
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
+
+	kref_init(&sim->ref);
+	spin_lock_init(&sim->lock);
+	init_waitqueue_head(&sim->srv_wq);
+	init_waitqueue_head(&sim->cli_wq);
+	sim->nr_slots = c.nr_slots;
+	sim->ring_size = PAGE_ALIGN(struct_size(sim->ring, slot, c.nr_slots));
+	sim->ring = vmalloc_user(sim->ring_size);
+	sim->busy = bitmap_zalloc(c.nr_slots, GFP_KERNEL);
+	sim->abandoned = bitmap_zalloc(c.nr_slots, GFP_KERNEL);
+	if (!sim->ring || !sim->busy || !sim->abandoned) {
+		err = -ENOMEM;
+		goto failure;
+	}
+
+	sim->ring->nr_slots = c.nr_slots;
+	for (i = 0; i < c.nr_slots; i++)
+		sim->ring->slot[i].seq = U64_MAX;	/* nothing posted */
+
+	mutex_lock(&sim_lock);
+	err = -EBUSY;
+	if (sf->sim)
+		goto failure_unlock;
+
+	err = -ENOSPC;
+	for (idx = 0; idx < SIM_MAX && sims[idx]; idx++)
+		;
+	if (idx == SIM_MAX)
+		goto failure_unlock;
+
+	sim->index = idx;
+	for (i = 0; i < 6; i++) {
+		if (!c.bar_len[i])
+			continue;
+
+		dev = device_create(pchar_class, NULL,
+				    MKDEV(MAJOR(sim_devt), 1 + idx * 6 + i),
+				    NULL, "sim%u_bar%u", idx, i);
+		if (IS_ERR(dev)) {
+			err = PTR_ERR(dev);
+			goto failure_device;
+		}
+		sim->len[i] = c.bar_len[i];
+	}
+
+	sims[idx] = sim;
+	sf->sim = sim;
+	mutex_unlock(&sim_lock);
+
+	c.index = idx;
+	return copy_to_user(uc, &c, sizeof(c)) ? -EFAULT : 0;
+
+failure_device:
+	for (i = 0; i < 6; i++)
+		if (sim->len[i])
+			device_destroy(pchar_class,
+				       MKDEV(MAJOR(sim_devt), 1 + idx * 6 + i));
+failure_unlock:
+	mutex_unlock(&sim_lock);
+failure:
+	kref_put(&sim->ref, sim_free);
+	return err;
+}
+
+/* Sleep until the kernel posted beyond the server's tail */
+static long sim_wait(struct sim_file *sf, u64 __user *utail)
+{
+	struct pchar_sim *sim = sf->sim;
+	u64 tail;
+
+	if (get_user(tail, utail))
+		return -EFAULT;
+
+	return wait_event_interruptible(sim->srv_wq,
+					READ_ONCE(sim->head) != tail);
+}
+
+static long sim_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct sim_file *sf = file->private_data;
+	void __user *argp = (void __user *)arg;
+
+	if (iminor(file_inode(file)))
+		return cmd == PCHAR_IOC_BATCH ? sim_batch(file, argp) :
+						-ENOTTY;
+
+	if (cmd == PCHAR_IOC_SIM_CREATE)
+		return sim_create(sf, argp);
+
+	if (!sf->sim)
+		return -ENXIO;
+
+	switch (cmd) {
+	case PCHAR_IOC_SIM_WAIT:
+		return sim_wait(sf, argp);
+
+	case PCHAR_IOC_SIM_WAKE:
+		wake_up_all(&sf->sim->cli_wq);
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* The server maps the ring at offset 0 of the control node */
+static int sim_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct sim_file *sf = file->private_data;
+
+	if (iminor(file_inode(file)) || !sf->sim)
+		return -ENXIO;
+
+	return remap_vmalloc_range(vma, sf->sim->ring, vma->vm_pgoff);
+}
+
+static const struct file_operations sim_fops = {
+	.owner	 = THIS_MODULE,
+	.llseek  = sim_seek,
+	.open	 = sim_open,
+	.release = sim_release,
+	.read	 = sim_read,
+	.write	 = sim_write,
+	.mmap	 = sim_mmap,
+	.unlocked_ioctl = sim_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
 };
 
-static char *pci_char_devnode(struct device *dev, umode_t *mode)
+static int sim_init(void)
+{
+	struct device *dev;
+	int err;
+
+	err = alloc_chrdev_region(&sim_devt, 0, SIM_MINORS, "pci-char-sim");
+	if (err)
+		return err;
+
+	cdev_init(&sim_cdev, &sim_fops);
+	sim_cdev.owner = THIS_MODULE;
+	err = cdev_add(&sim_cdev, sim_devt, SIM_MINORS);
+	if (err)
+		goto failure_cdev_add;
+
+	dev = device_create(pchar_class, NULL, sim_devt, NULL, "sim");
+	if (IS_ERR(dev)) {
+		err = PTR_ERR(dev);
+		goto failure_device_create;
+	}
+
+	return 0;
+
+failure_device_create:
+	cdev_del(&sim_cdev);
+failure_cdev_add:
+	unregister_chrdev_region(sim_devt, SIM_MINORS);
+	return err;
+}
+
+static void sim_exit(void)
 {
-	struct pci_dev *pdev = to_pci_dev(dev->parent);
+	device_destroy(pchar_class, sim_devt);
+	cdev_del(&sim_cdev);
+	unregister_chrdev_region(sim_devt, SIM_MINORS);
+}
+
+static char *pci_char_devnode(PCHAR_DEVNODE_CONST struct device *dev,
+			      umode_t *mode)
+{
+	struct pci_dev *pdev;
+
+	if (MAJOR(dev->devt) == MAJOR(sim_devt)) {
+		if (!MINOR(dev->devt))
+			return kasprintf(GFP_KERNEL, "pci-char/sim");
+		return kasprintf(GFP_KERNEL, "pci-char/sim%u/bar%u",
+				 (MINOR(dev->devt) - 1) / 6,
+				 (MINOR(dev->devt) - 1) % 6);
+	}
+
+	pdev = to_pci_dev(dev->parent);
+
+	if (MINOR(dev->devt) == FUNC_MINOR)
+		return kasprintf(GFP_KERNEL, "pci-char/%02x:%02x.%02x/func",
+				 pdev->bus->number,
+				 PCI_SLOT(pdev->devfn),
+				 PCI_FUNC(pdev->devfn));
+
+	if (MINOR(dev->devt) > 5)
+		return kasprintf(GFP_KERNEL, "pci-char/%02x:%02x.%02x/win%d",
+				 pdev->bus->number,
+				 PCI_SLOT(pdev->devfn),
+				 PCI_FUNC(pdev->devfn),
+				 MINOR(dev->devt) - 6);
+
 	return kasprintf(GFP_KERNEL, "pci-char/%02x:%02x.%02x/bar%d",
 			 pdev->bus->number,
 			 PCI_SLOT(pdev->devfn),
@@ -353,13 +6136,20 @@ static int __init pci_init(void)
 	int err;
 	char *p, *id;
 
-	pchar_class = class_create(THIS_MODULE, "pci-char");
+	wc_select();
+	pmu_init();
+
+	pchar_class = pchar_class_create("pci-char");
 	if (IS_ERR(pchar_class)) {
 		err = PTR_ERR(pchar_class);
-		return err;
+		goto failure_class;
 	}
 	pchar_class->devnode = pci_char_devnode;
 
+	err = sim_init();
+	if (err)
+		goto failure_sim;
+
 	err = pci_register_driver(&pchar_driver);
 	if (err)
 		goto failure_register_driver;
@@ -399,15 +6189,23 @@ static int __init pci_init(void)
 	return 0;
 
 failure_register_driver:
+	sim_exit();
+
+failure_sim:
 	class_destroy(pchar_class);
 
+failure_class:
+	pmu_exit();
+
 	return err;	
 }
 
 static void __exit pci_exit(void)
 {
 	pci_unregister_driver(&pchar_driver);
+	sim_exit();
 	class_destroy(pchar_class);
+	pmu_exit();
 }
 
 module_init(pci_init);
@@ -417,3 +6215,7 @@ MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("generic pci to chardev driver");
 MODULE_AUTHOR("Andre Richter <andre.o.richter @t gmail_com>");
 
+
+#ifdef CONFIG_PCI_CHAR_KUNIT_TEST
+#include "pci-char-test.c"
+#endif
@@ -0,0 +1,483 @@
+/*
+ * ==========================================================
+ *
+ * User space interface of the pci-char driver
+ * Copyright (C) 2012-2014  Andre Richter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ==========================================================
+ *
+ * The ioctls are issued on the barN character devices and
+ * act on that BAR unless noted otherwise. Offsets and lengths
+ * are given in bytes and have to be 4 byte aligned.
+ *
+ * The func device of a PCI function reaches all of its BARs.
+ * There the BAR index is encoded above PCHAR_FUNC_BAR_SHIFT in
+ * file positions, mmap() offsets and ioctl offsets, and whole-BAR
+ * ioctls act on every BAR.
+ */
+
+#ifndef _PCI_CHAR_H
+#define _PCI_CHAR_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define PCHAR_IOC_MAGIC 'P'
+
+#define PCHAR_FUNC_BAR_SHIFT	40
+#define PCHAR_FUNC_OFFSET(bar, offset) \
+	(((__u64)(bar) << PCHAR_FUNC_BAR_SHIFT) | (offset))
+
+/* Window of a BAR */
+struct pchar_range {
+	__u64 offset;
+	__u64 len;
+};
+
+/* Drop the shadow copy of all cached registers of the BAR */
+#define PCHAR_IOC_CACHE_INVAL		_IO(PCHAR_IOC_MAGIC, 0x00)
+/* Drop the shadow copy of the cached registers inside a window */
+#define PCHAR_IOC_CACHE_INVAL_RANGE	_IOW(PCHAR_IOC_MAGIC, 0x01, \
+					     struct pchar_range)
+
+/*
+ * Stage contiguous writes of this file in a kernel buffer (non-zero)
+ * and emit them as bursts on fsync(), close(), a full buffer, a
+ * non-contiguous write or a read of a staged register. Zero flushes
+ * and switches back to immediate writes.
+ */
+#define PCHAR_IOC_WRITE_STAGING		_IOW(PCHAR_IOC_MAGIC, 0x02, __u32)
+
+#define PCHAR_OP_READ	0
+#define PCHAR_OP_WRITE	1
+
+/* Single 32 bit register access of a batch or job */
+struct pchar_op {
+	__u32 cmd;	/* PCHAR_OP_* */
+	__u32 bar;	/* BAR of the file, any BAR on the func device */
+	__u64 offset;
+	__u32 value;	/* value to write, or value read */
+	__u32 reserved;
+};
+
+/* Execute ops in order, read values are stored back into the array */
+struct pchar_batch {
+	__u64 ops;	/* pointer to struct pchar_op array */
+	__u32 nr_ops;
+	__u32 reserved;
+};
+
+#define PCHAR_IOC_BATCH			_IOWR(PCHAR_IOC_MAGIC, 0x03, \
+					      struct pchar_batch)
+
+/* data points to len bytes written to offset instead of to ops */
+#define PCHAR_JOB_BULK		(1 << 0)
+
+/*
+ * Asynchronous job run by the per device executor thread. Jobs of
+ * all processes are served round robin. Completion is signalled
+ * through poll() on the file and the optional eventfd, and reaped
+ * with PCHAR_IOC_JOB_WAIT which also stores read values back to
+ * the ops array given at submission.
+ */
+struct pchar_job {
+	__u64 data;	/* pointer to struct pchar_op array or bulk data */
+	__u64 len;	/* number of ops, or bytes with PCHAR_JOB_BULK */
+	__u64 offset;	/* destination with PCHAR_JOB_BULK */
+	__u32 flags;	/* PCHAR_JOB_* */
+	__s32 eventfd;	/* signalled on completion, -1 for none */
+	__u64 id;	/* returned by PCHAR_IOC_JOB_SUBMIT */
+};
+
+#define PCHAR_WAIT_NONBLOCK	(1 << 0)
+
+struct pchar_job_wait {
+	__u64 id;	/* 0 reaps any completed job and returns its id */
+	__s32 status;	/* 0 or negative errno of the job */
+	__u32 flags;	/* PCHAR_WAIT_* */
+};
+
+#define PCHAR_IOC_JOB_SUBMIT		_IOWR(PCHAR_IOC_MAGIC, 0x04, \
+					      struct pchar_job)
+#define PCHAR_IOC_JOB_WAIT		_IOWR(PCHAR_IOC_MAGIC, 0x05, \
+					      struct pchar_job_wait)
+
+/* Progress of a job, done and len count ops or bytes */
+struct pchar_job_status {
+	__u64 id;
+	__u64 done;
+	__u64 len;
+	__u32 crc;	/* CRC32 of a completed load */
+	__u32 complete;
+};
+
+#define PCHAR_IOC_JOB_STATUS		_IOWR(PCHAR_IOC_MAGIC, 0x06, \
+					      struct pchar_job_status)
+
+/* Stream into the single register at offset instead of a window */
+#define PCHAR_LOAD_FIFO		(1 << 0)
+/* Fail the job with EBADMSG if the CRC32 of the image is not crc */
+#define PCHAR_LOAD_CRC		(1 << 1)
+/* Read back the window and fail the job with EIO on a mismatch */
+#define PCHAR_LOAD_VERIFY	(1 << 2)
+
+/*
+ * Stream a firmware image or bitstream into the BAR as a job. The
+ * image is taken from the firmware loader if name is set, and from
+ * the regular file fd otherwise. Progress is queried with
+ * PCHAR_IOC_JOB_STATUS and the result reaped with PCHAR_IOC_JOB_WAIT.
+ */
+struct pchar_load {
+	char name[64];	/* file below /lib/firmware, or empty */
+	__s32 fd;	/* source if name is empty */
+	__u32 flags;	/* PCHAR_LOAD_* */
+	__u64 offset;	/* window start or FIFO register */
+	__u32 crc;	/* expected CRC32 with PCHAR_LOAD_CRC */
+	__s32 eventfd;	/* signalled on completion, -1 for none */
+	__u64 id;	/* returned */
+};
+
+#define PCHAR_IOC_LOAD			_IOWR(PCHAR_IOC_MAGIC, 0x07, \
+					      struct pchar_load)
+
+#define PCHAR_MAX_DOORBELLS	64
+
+/* Enable the doorbell, a configuration without it disables it */
+#define PCHAR_DB_ENABLE		(1 << 0)
+/* Doorbell is a 64 bit register */
+#define PCHAR_DB_64BIT		(1 << 1)
+/*
+ * Map the doorbell page write-combined instead of uncached, only on
+ * BARs mapped write combining through wc_bars
+ */
+#define PCHAR_DB_WC		(1 << 2)
+
+/* Doorbell register of a queue, in the BAR of the file */
+struct pchar_db_cfg {
+	__u32 queue;	/* 0 .. PCHAR_MAX_DOORBELLS - 1 */
+	__u32 flags;	/* PCHAR_DB_* */
+	__u64 offset;
+};
+
+#define PCHAR_IOC_DB_SET		_IOW(PCHAR_IOC_MAGIC, 0x08, \
+					     struct pchar_db_cfg)
+
+struct pchar_db {
+	__u32 queue;
+	__u32 reserved;
+	__u64 value;
+};
+
+/*
+ * Ring doorbells in one call. Only the last value of every queue in
+ * the array is written, queues are written in ascending order.
+ */
+struct pchar_db_ring {
+	__u64 ring;	/* pointer to struct pchar_db array */
+	__u32 nr;
+	__u32 reserved;
+};
+
+#define PCHAR_IOC_DB_RING		_IOW(PCHAR_IOC_MAGIC, 0x09, \
+					     struct pchar_db_ring)
+
+/*
+ * mmap() offset of the page holding the doorbell of queue q. The
+ * mapping has to be exactly one page long, the doorbell sits at
+ * offset % page size within it.
+ */
+#define PCHAR_DB_MMAP_BASE	(1ULL << 43)
+#define PCHAR_DB_MMAP_STRIDE	0x10000ULL
+#define PCHAR_DB_MMAP_OFFSET(q)	(PCHAR_DB_MMAP_BASE + \
+				 (__u64)(q) * PCHAR_DB_MMAP_STRIDE)
+
+#define PCHAR_WAIT_NO_IRQ	0xffffffff
+
+/* How a PCHAR_IOC_WAIT completed */
+#define PCHAR_WAITED_SPIN	1	/* while busy polling */
+#define PCHAR_WAITED_IRQ	2	/* after sleeping on the vector */
+#define PCHAR_WAITED_POLL	3	/* after sleeping without vector */
+
+/*
+ * Wait until (register & mask) == value. The register is busy polled
+ * for spin_ns first (capped by the wait_spin_max_ns module parameter,
+ * and cut short by signals or rescheduling), then the caller sleeps on the interrupt vector
+ * (or polls at a growing interval without one) until timeout_ns have
+ * passed in total, 0 waits forever. Fails with ETIMEDOUT on timeout,
+ * last holds the register value read last in any case.
+ */
+struct pchar_wait {
+	__u64 offset;
+	__u32 mask;
+	__u32 value;
+	__u64 spin_ns;
+	__u64 timeout_ns;
+	__u32 vector;	/* MSI-X/MSI vector or PCHAR_WAIT_NO_IRQ */
+	__u32 result;	/* PCHAR_WAITED_* */
+	__u32 last;
+	__u32 reserved;
+};
+
+#define PCHAR_IOC_WAIT			_IOWR(PCHAR_IOC_MAGIC, 0x0a, \
+					      struct pchar_wait)
+
+/* Signal an eventfd on every interrupt of a vector, -1 detaches */
+struct pchar_irq_eventfd {
+	__u32 vector;
+	__s32 fd;
+};
+
+#define PCHAR_IOC_IRQ_EVENTFD		_IOW(PCHAR_IOC_MAGIC, 0x0b, \
+					     struct pchar_irq_eventfd)
+
+#define PCHAR_ATOMIC_ADD	0
+#define PCHAR_ATOMIC_AND	1
+#define PCHAR_ATOMIC_OR		2
+#define PCHAR_ATOMIC_XOR	3
+#define PCHAR_ATOMIC_SWAP	4
+#define PCHAR_ATOMIC_CAS	5	/* store value if old equals compare */
+
+#define PCHAR_ATOMIC_64BIT	(1 << 0)
+
+/*
+ * Read-modify-write of a 32 or 64 bit register, serialised against
+ * every other atomic on the same register of the device, though not
+ * against plain accesses. old returns the previous value; a failed
+ * compare is not an error, it shows as old != compare.
+ */
+struct pchar_atomic {
+	__u64 offset;
+	__u32 op;	/* PCHAR_ATOMIC_* */
+	__u32 flags;
+	__u64 value;
+	__u64 compare;
+	__u64 old;
+};
+
+#define PCHAR_IOC_ATOMIC		_IOWR(PCHAR_IOC_MAGIC, 0x0c, \
+					      struct pchar_atomic)
+
+/* The device writes the producer into the status page, not prod_reg */
+#define PCHAR_CAPTURE_WRITEBACK	(1 << 0)
+
+/* Register offset of a struct pchar_capture the device does not have */
+#define PCHAR_CAPTURE_NO_REG	(~0ULL)
+
+/*
+ * Continuous device to host capture into a DMA ring of the open file.
+ * The bus address and size of the ring are programmed into the given
+ * registers, in the BAR of the file, before ctrl_enable is written to
+ * ctrl_reg; writing 0 there stops the device. The device writes data
+ * from the start of the ring and advances the producer, a free running
+ * 32 bit byte count starting at 0, either in prod_reg or, with
+ * PCHAR_CAPTURE_WRITEBACK, by writing it to the start of the status
+ * page whose bus address goes to wb_lo/wb_hi. Every consumer update
+ * is written to cons_reg, so the device can stall on a full ring.
+ */
+struct pchar_capture {
+	__u64 size;		/* power of two, a page up to 1 GiB */
+	__u32 watermark;	/* pending bytes for poll() to report */
+	__u32 flags;		/* PCHAR_CAPTURE_* */
+	__u32 vector;	/* MSI-X/MSI vector or PCHAR_WAIT_NO_IRQ */
+	__u32 poll_us;	/* producer poll period without vector */
+	__u32 ctrl_enable;
+	__u32 reserved;
+	__u64 base_lo;
+	__u64 base_hi;
+	__u64 size_reg;
+	__u64 prod_reg;
+	__u64 cons_reg;
+	__u64 wb_lo;
+	__u64 wb_hi;
+	__u64 ctrl_reg;
+};
+
+#define PCHAR_IOC_CAPTURE_START		_IOW(PCHAR_IOC_MAGIC, 0x0d, \
+					     struct pchar_capture)
+#define PCHAR_IOC_CAPTURE_STOP		_IO(PCHAR_IOC_MAGIC, 0x0e)
+/* Hand a __u32 number of read bytes back to the device */
+#define PCHAR_IOC_CAPTURE_ADVANCE	_IOW(PCHAR_IOC_MAGIC, 0x0f, __u32)
+
+#define PCHAR_STREAM_RUNNING	(1 << 0)
+#define PCHAR_CAPTURE_FULL	(1 << 1)	/* device is held back */
+
+/* First page of the status mapping, updated by driver and device */
+struct pchar_capture_status {
+	__u32 producer;
+	__u32 consumer;
+	__u32 flags;		/* PCHAR_STREAM_RUNNING, PCHAR_CAPTURE_FULL */
+	__u32 reserved;
+	__u64 overflows;	/* times the producer overran the consumer */
+	__u64 lost;		/* bytes dropped by overruns */
+	__u64 full;		/* times the ring filled up */
+};
+
+/*
+ * mmap() offsets of the read-only status page and ring of the capture.
+ * Data at producer % size is valid once producer is seen to pass it.
+ */
+#define PCHAR_CAPTURE_MMAP_STATUS	(12ULL << 40)
+#define PCHAR_CAPTURE_MMAP_RING		(14ULL << 40)
+
+/* The device writes the consumer into the status page, not cons_reg */
+#define PCHAR_PLAYBACK_WRITEBACK	(1 << 0)
+
+/*
+ * Continuous host to device playback from nr_buffers DMA buffers of
+ * buffer_size bytes each, back to back in one ring. The registers are
+ * programmed like those of a capture, but here user space produces:
+ * it fills buffers through the mapping at PCHAR_PLAYBACK_MMAP_RING and
+ * submits them in order with PCHAR_IOC_PLAYBACK_SUBMIT, which writes
+ * the producer byte count to prod_reg. The device fetches up to there
+ * and advances the consumer in cons_reg or, with
+ * PCHAR_PLAYBACK_WRITEBACK, in the consumer field of the status page.
+ */
+struct pchar_playback {
+	__u32 nr_buffers;	/* power of two */
+	__u32 buffer_size;	/* power of two, 1 GiB in total at most */
+	__u32 watermark;	/* free buffers for poll() to report */
+	__u32 flags;		/* PCHAR_PLAYBACK_* */
+	__u32 vector;	/* MSI-X/MSI vector or PCHAR_WAIT_NO_IRQ */
+	__u32 poll_us;	/* consumer poll period without vector */
+	__u32 ctrl_enable;
+	__u32 reserved;
+	__u64 base_lo;
+	__u64 base_hi;
+	__u64 size_reg;
+	__u64 prod_reg;
+	__u64 cons_reg;
+	__u64 wb_lo;
+	__u64 wb_hi;
+	__u64 ctrl_reg;
+};
+
+#define PCHAR_IOC_PLAYBACK_START	_IOW(PCHAR_IOC_MAGIC, 0x10, \
+					     struct pchar_playback)
+#define PCHAR_IOC_PLAYBACK_STOP		_IO(PCHAR_IOC_MAGIC, 0x11)
+/* Submit a __u32 number of filled buffers */
+#define PCHAR_IOC_PLAYBACK_SUBMIT	_IOW(PCHAR_IOC_MAGIC, 0x12, __u32)
+
+#define PCHAR_PLAYBACK_EMPTY	(1 << 1)	/* device is starved */
+
+struct pchar_playback_status {
+	__u32 producer;
+	__u32 consumer;
+	__u32 flags;		/* PCHAR_STREAM_RUNNING, PCHAR_PLAYBACK_EMPTY */
+	__u32 reserved;
+	__u64 underruns;	/* times a running device drained the ring */
+};
+
+#define PCHAR_PLAYBACK_MMAP_STATUS	(13ULL << 40)
+#define PCHAR_PLAYBACK_MMAP_RING	(15ULL << 40)
+
+/*
+ * BAR and offset behind an address in a mapping of p2pmem/allocate of
+ * the PCI device, e.g. to tell the device where an O_DIRECT read into
+ * the buffer landed.
+ */
+struct pchar_p2p_offset {
+	__u64 addr;
+	__u64 offset;	/* returned */
+	__u32 bar;	/* returned */
+	__u32 reserved;
+};
+
+#define PCHAR_IOC_P2P_OFFSET		_IOWR(PCHAR_IOC_MAGIC, 0x13, \
+					      struct pchar_p2p_offset)
+
+/*
+ * Simulated devices. A model server opening /dev/pci-char/sim creates
+ * one with PCHAR_IOC_SIM_CREATE. Its BARs show up as
+ * /dev/pci-char/simN/barM, and every read(), write() and
+ * PCHAR_IOC_BATCH op on them is posted as a slot into a ring in memory
+ * shared with the server, who maps it at offset 0 of the control node.
+ *
+ * The server takes slot seq % nr_slots once its seq equals the next
+ * sequence number it expects, stores the value of a read, then sets
+ * done. If it then finds waiting set, the caller went to sleep and
+ * needs PCHAR_IOC_SIM_WAKE. A server that does not want to poll head
+ * sleeps with PCHAR_IOC_SIM_WAIT.
+ */
+struct pchar_sim_slot {
+	__u64 seq;	/* written last by the kernel */
+	__u64 offset;
+	__u32 bar;
+	__u32 op;	/* PCHAR_OP_READ or PCHAR_OP_WRITE */
+	__u32 value;	/* value written, or read by the server */
+	__u32 done;	/* written last by the server */
+	__u32 waiting;
+	__u32 reserved[3];
+};
+
+struct pchar_sim_ring {
+	__u64 head;	/* next sequence number to be posted */
+	__u32 nr_slots;
+	__u32 reserved[13];
+	struct pchar_sim_slot slot[];
+};
+
+struct pchar_sim_create {
+	__u64 bar_len[6];	/* multiple of 4, 0 for none */
+	__u32 nr_slots;		/* power of two up to 4096 */
+	__u32 index;		/* returned, N of simN */
+};
+
+#define PCHAR_IOC_SIM_CREATE		_IOWR(PCHAR_IOC_MAGIC, 0x14, \
+					      struct pchar_sim_create)
+/* Sleep until head differs from the __u64 passed */
+#define PCHAR_IOC_SIM_WAIT		_IOW(PCHAR_IOC_MAGIC, 0x15, __u64)
+#define PCHAR_IOC_SIM_WAKE		_IO(PCHAR_IOC_MAGIC, 0x16)
+
+/*
+ * Signal an eventfd whenever the device enters or leaves error
+ * recovery, or a reset, a __s32 fd of -1 stops. Meanwhile poll()
+ * reports EPOLLPRI and accesses wait for the device to come back.
+ */
+#define PCHAR_IOC_ERR_EVENTFD		_IOW(PCHAR_IOC_MAGIC, 0x17, __s32)
+
+/*
+ * Read-only status page of the device, mapped at PCHAR_STATUS_MMAP of
+ * any of its nodes. The driver refreshes it in place every status_ms
+ * milliseconds, so monitors read it without system calls:
+ *
+ *	do {
+ *		seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+ *		copy = *st;
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while (seq & 1 || seq != __atomic_load_n(&st->seq,
+ *						   __ATOMIC_RELAXED));
+ *
+ * Fields are only ever added at the end of the reserved space, with a
+ * new version; irqs[] stays where it is.
+ */
+#define PCHAR_STATUS_VERSION	2
+#define PCHAR_STATUS_MMAP	(7ULL << 40)
+
+struct pchar_status_page {
+	__u32 version;		/* PCHAR_STATUS_VERSION */
+	__u32 seq;		/* odd while the driver updates */
+	__u64 updated_ns;	/* CLOCK_MONOTONIC of this snapshot */
+	__u64 reset_ns;		/* CLOCK_REALTIME of the last reset */
+	__u32 link_speed;	/* PCI_EXP_LNKSTA_CLS, 0 if unknown */
+	__u32 link_width;	/* negotiated lanes, 0 if link is down */
+	__u64 mmio_reads;
+	__u64 mmio_writes;
+	__u64 read_bytes;
+	__u64 write_bytes;
+	__u64 dma_bytes;	/* moved by capture and playback rings */
+	__u64 wait_timeouts;	/* PCHAR_IOC_WAIT that timed out */
+	__u64 errors;		/* PCIe errors reported, since version 2 */
+	__u64 recoveries;	/* completed error recoveries and resets */
+	__u64 recovery_ns;	/* duration of the last one */
+	__u64 reserved[13];
+	__u32 nr_irqs;		/* valid entries of irqs[] */
+	__u32 reserved2;
+	__u64 irqs[];		/* interrupts per vector */
+};
+
+#endif /* _PCI_CHAR_H */
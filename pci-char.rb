@@ -9,6 +9,7 @@
 #
 # Usage:
 #  ./pci-char.rb /dev/pci-char/bb:dd.f/barX address [new value]
+#  ./pci-char.rb /dev/pci-char/bb:dd.f/barX load address image [fifo]
 #
 # Example read:
 #  ./pci-char.rb /dev/pci-char/01\:00.01/bar3 0x0
@@ -16,6 +17,9 @@
 # Example write:
 #  ./pci-char.rb /dev/pci-char/01\:00.01/bar3 0x0 0xcafe
 #
+# Example upload of a bitstream into the FIFO register at 0x100:
+#  ./pci-char.rb /dev/pci-char/01\:00.01/bar3 load 0x100 top.bit fifo
+#
 # Alternatively, you can include the file in your own
 # scripts and use the read and write methods.
 #
@@ -27,6 +31,19 @@
 
 module PCIChar
 
+  # _IOWR('P', nr, size) of pci-char.h
+  def self.iowr(nr, size)
+    (3 << 30) | (size << 16) | ('P'.ord << 8) | nr
+  end
+
+  IOC_JOB_WAIT = iowr(0x05, 16)
+  IOC_LOAD     = iowr(0x07, 96)
+  LOAD_FIFO    = 1
+
+  # struct pchar_load and struct pchar_job_wait
+  LOAD_FMT = "a64lLQLlQ"
+  WAIT_FMT = "QlL"
+
   def self.read(dev, addr)
     f = File.open(dev, "rb")
     f.seek(addr, IO::SEEK_SET)
@@ -42,6 +59,21 @@ module PCIChar
     f.close
   end 
 
+  # Stream an image file into the BAR in the kernel, either into the
+  # window starting at addr or into the FIFO register at addr.
+  # Returns 0 or the negative errno of the job.
+  def self.load(dev, addr, image, fifo = false)
+    f = File.open(dev, "r+b")
+    src = File.open(image, "rb")
+    arg = ["", src.fileno, fifo ? LOAD_FIFO : 0, addr, 0, -1, 0].pack(LOAD_FMT)
+    f.ioctl(IOC_LOAD, arg)
+    wait = [arg.unpack(LOAD_FMT)[6], 0, 0].pack(WAIT_FMT)
+    f.ioctl(IOC_JOB_WAIT, wait)
+    src.close
+    f.close
+    return wait.unpack(WAIT_FMT)[1]
+  end
+
 end
 
 if __FILE__ == $0
@@ -59,7 +91,16 @@ if __FILE__ == $0
     exit
   end
 
-  if (ARGV.length == 3)
+  if (ARGV[1] == "load" and ARGV.length >= 4)
+    addr = arg_to_int(ARGV[2].dup)
+    if (addr < 0)
+      puts "address not a valid hex word"
+      exit
+    end
+    status = PCIChar::load(ARGV[0].dup, addr, ARGV[3].dup, ARGV[4] == "fifo")
+    puts "load failed (#{status})" if status != 0
+
+  elsif (ARGV.length == 3)
     addr = arg_to_int(ARGV[1].dup)
     if (addr < 0)
       puts "first argument not a valid hex word"
@@ -84,7 +125,10 @@ if __FILE__ == $0
   else
     print "\nUsage: ./pcietools.rb /dev/pci-char/bb:dd.f/barX address [new value]\n"
     print "\taddress must be 4 Byte aligned and 4 Byte long.\n"
-    print "\t[new value] must be 4 Byte long.\n\n"
+    print "\t[new value] must be 4 Byte long.\n"
+    print "\n       ./pci-char.rb /dev/pci-char/bb:dd.f/barX load address image [fifo]\n"
+    print "\tstreams image into the BAR window at address, or into the\n"
+    print "\tFIFO register at address if fifo is given.\n\n"
     print  "Example: ./pci-char.rb 0x0 0x8\n\n"
   end
 
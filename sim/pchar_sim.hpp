@@ -0,0 +1,176 @@
+/*
+ * ==========================================================
+ *
+ * Model server library for simulated pci-char devices
+ * Copyright (C) 2012-2014  Andre Richter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ==========================================================
+ *
+ * Creates a simulated device with the BARs given and answers the
+ * accesses to /dev/pci-char/simN/barM from a model, e.g.:
+ *
+ *   struct Regs : pchar::SimModel {
+ *       uint32_t r[16] = {};
+ *       uint32_t read(unsigned bar, uint64_t off) override
+ *           { return r[off / 4 % 16]; }
+ *       void write(unsigned bar, uint64_t off, uint32_t v) override
+ *           { r[off / 4 % 16] = v; }
+ *   };
+ *
+ *   pchar::SimServer srv({0x1000});
+ *   Regs regs;
+ *   srv.run(regs, stop);
+ *
+ * Accesses are answered one at a time in the order they were made.
+ * The server polls the ring for spin_us after the last access before
+ * it sleeps in the kernel, so keep a core free for it when measuring.
+ */
+
+#ifndef PCHAR_SIM_HPP
+#define PCHAR_SIM_HPP
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../pci-char.h"
+
+namespace pchar {
+
+/* Behaviour of the simulated device, called from the serving thread */
+struct SimModel {
+	virtual ~SimModel() = default;
+	virtual uint32_t read(unsigned bar, uint64_t offset) = 0;
+	virtual void write(unsigned bar, uint64_t offset, uint32_t value) = 0;
+};
+
+class SimServer {
+public:
+	explicit SimServer(const std::array<uint64_t, 6> &bar_len,
+			   unsigned nr_slots = 256,
+			   const char *ctl = "/dev/pci-char/sim")
+	{
+		struct pchar_sim_create c = {};
+
+		fd_ = ::open(ctl, O_RDWR | O_CLOEXEC);
+		if (fd_ < 0)
+			fail("open");
+
+		for (unsigned i = 0; i < 6; i++)
+			c.bar_len[i] = bar_len[i];
+		c.nr_slots = nr_slots;
+		if (::ioctl(fd_, PCHAR_IOC_SIM_CREATE, &c))
+			fail("PCHAR_IOC_SIM_CREATE");
+		index_ = c.index;
+
+		size_ = sizeof(*ring_) + nr_slots * sizeof(ring_->slot[0]);
+		void *p = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd_, 0);
+		if (p == MAP_FAILED)
+			fail("mmap");
+		ring_ = static_cast<struct pchar_sim_ring *>(p);
+		mask_ = nr_slots - 1;
+	}
+
+	~SimServer()
+	{
+		if (ring_)
+			::munmap(ring_, size_);
+		if (fd_ >= 0)
+			::close(fd_);	/* removes the device */
+	}
+
+	SimServer(const SimServer &) = delete;
+	SimServer &operator=(const SimServer &) = delete;
+
+	/* N of /dev/pci-char/simN */
+	unsigned index() const { return index_; }
+
+	/* Answer everything posted so far, returns the number answered */
+	unsigned poll(SimModel &model)
+	{
+		bool wake = false;
+		unsigned n = 0;
+
+		for (;; n++, tail_++) {
+			struct pchar_sim_slot *s = &ring_->slot[tail_ & mask_];
+
+			if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail_)
+				break;
+
+			if (s->op == PCHAR_OP_READ)
+				s->value = model.read(s->bar, s->offset);
+			else
+				model.write(s->bar, s->offset, s->value);
+
+			/* pairs with the barrier of a caller going to sleep */
+			__atomic_store_n(&s->done, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&s->waiting, __ATOMIC_SEQ_CST))
+				wake = true;
+		}
+
+		if (wake && ::ioctl(fd_, PCHAR_IOC_SIM_WAKE))
+			fail("PCHAR_IOC_SIM_WAKE");
+
+		return n;
+	}
+
+	/* Serve until stop is set, spinning for spin_us before sleeping */
+	void run(SimModel &model, const std::atomic<bool> &stop,
+		 unsigned spin_us = 50)
+	{
+		using clock = std::chrono::steady_clock;
+		auto idle = clock::now();
+
+		while (!stop.load(std::memory_order_relaxed)) {
+			if (poll(model)) {
+				idle = clock::now();
+				continue;
+			}
+
+			if (clock::now() - idle <
+			    std::chrono::microseconds(spin_us))
+				continue;
+
+			/* a signal interrupts the sleep to check stop */
+			if (::ioctl(fd_, PCHAR_IOC_SIM_WAIT, &tail_) &&
+			    errno != EINTR)
+				fail("PCHAR_IOC_SIM_WAIT");
+			idle = clock::now();
+		}
+	}
+
+private:
+	[[noreturn]] static void fail(const char *what)
+	{
+		throw std::system_error(errno, std::generic_category(),
+					std::string("pci-char sim: ") + what);
+	}
+
+	int fd_ = -1;
+	unsigned index_ = 0;
+	struct pchar_sim_ring *ring_ = nullptr;
+	size_t size_ = 0;
+	uint64_t mask_ = 0;
+	uint64_t tail_ = 0;
+};
+
+} /* namespace pchar */
+
+#endif /* PCHAR_SIM_HPP */
@@ -0,0 +1,146 @@
+/*
+ * ==========================================================
+ *
+ * Verilator adapter for simulated pci-char devices
+ * Copyright (C) 2012-2014  Andre Richter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ==========================================================
+ *
+ * Serves BAR0 of a simulated device from a Verilated design whose top
+ * level mmio_top has a simple register interface:
+ *
+ *   input         clk, rst_n
+ *   input         req_valid, req_write
+ *   input  [2:0]  req_bar
+ *   input  [31:0] req_addr, req_wdata
+ *   output        req_ready
+ *   output        rsp_valid	one cycle per read, after the request
+ *   output [31:0] rsp_rdata
+ *
+ * A request is taken on the rising edge with req_valid and req_ready
+ * high. The design is only clocked while it serves an access, a read
+ * the design does not answer within MAX_CYCLES returns all ones like a
+ * completion timeout would.
+ *
+ * Build and run, e.g.:
+ *
+ *   verilator --cc --exe --build -CFLAGS -std=c++17 -CFLAGS -I$PWD/sim \
+ *       mmio_top.sv sim/verilator_example.cpp -o mmio_sim
+ *   ./obj_dir/mmio_sim 0x10000
+ *
+ * and access /dev/pci-char/simN/bar0 as printed.
+ */
+
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Vmmio_top.h"
+#include "verilated.h"
+
+#include "pchar_sim.hpp"
+
+static const uint64_t MAX_CYCLES = 1000000;
+
+static std::atomic<bool> stop;
+
+class VerilatorModel : public pchar::SimModel {
+public:
+	explicit VerilatorModel(Vmmio_top &top) : top_(top)
+	{
+		top_.rst_n = 0;
+		top_.req_valid = 0;
+		for (int i = 0; i < 10; i++)
+			tick();
+		top_.rst_n = 1;
+		tick();
+	}
+
+	uint32_t read(unsigned bar, uint64_t offset) override
+	{
+		uint64_t n;
+
+		if (!request(false, bar, offset, 0))
+			return ~0u;
+
+		for (n = 0; !top_.rsp_valid && n < MAX_CYCLES; n++)
+			tick();
+		if (!top_.rsp_valid)
+			return ~0u;
+
+		uint32_t value = top_.rsp_rdata;
+		tick();
+		return value;
+	}
+
+	void write(unsigned bar, uint64_t offset, uint32_t value) override
+	{
+		request(true, bar, offset, value);
+	}
+
+	uint64_t cycles() const { return cycles_; }
+
+private:
+	void tick()
+	{
+		top_.clk = 0;
+		top_.eval();
+		top_.clk = 1;
+		top_.eval();
+		cycles_++;
+	}
+
+	bool request(bool write, unsigned bar, uint64_t offset, uint32_t value)
+	{
+		uint64_t n;
+
+		top_.req_valid = 1;
+		top_.req_write = write;
+		top_.req_bar = bar;
+		top_.req_addr = offset;
+		top_.req_wdata = value;
+		top_.eval();
+
+		for (n = 0; !top_.req_ready && n < MAX_CYCLES; n++)
+			tick();
+		bool taken = top_.req_ready;
+		tick();
+
+		top_.req_valid = 0;
+		top_.eval();
+		return taken;
+	}
+
+	Vmmio_top &top_;
+	uint64_t cycles_ = 0;
+};
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa = {};
+	uint64_t len = argc > 1 ? strtoull(argv[1], nullptr, 0) : 0x10000;
+
+	Verilated::commandArgs(argc, argv);
+
+	/* no SA_RESTART, the sleeping server has to see stop */
+	sa.sa_handler = [](int) { stop = true; };
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	Vmmio_top top;
+	VerilatorModel model(top);
+	pchar::SimServer srv({len});
+
+	printf("serving /dev/pci-char/sim%u/bar0\n", srv.index());
+	srv.run(model, stop);
+	printf("%llu cycles simulated\n", (unsigned long long)model.cycles());
+
+	top.final();
+	return 0;
+}